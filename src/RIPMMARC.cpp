@@ -0,0 +1,224 @@
+#include <exception>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <RcppANTsR.h>
+#include "itkImage.h"
+#include "itkRIPMMARCImageFilter.h"
+
+// both computation types are built for every image type R can hand over;
+// float keeps the patch matrices and the SVD input at half the size
+template class itk::RIPMMARCImageFilter< itk::Image< float, 2 >, itk::Image< float, 2 >, float >;
+template class itk::RIPMMARCImageFilter< itk::Image< float, 2 >, itk::Image< float, 2 >, double >;
+template class itk::RIPMMARCImageFilter< itk::Image< float, 3 >, itk::Image< float, 3 >, float >;
+template class itk::RIPMMARCImageFilter< itk::Image< float, 3 >, itk::Image< float, 3 >, double >;
+
+template< class MatrixType >
+Rcpp::NumericMatrix ripmmarcMatrixToR( const MatrixType & matrix )
+{
+  Rcpp::NumericMatrix out( matrix.rows(), matrix.cols() );
+  for ( unsigned int i = 0; i < matrix.rows(); i++ )
+    {
+    for ( unsigned int j = 0; j < matrix.cols(); j++ )
+      {
+      out( i, j ) = matrix( i, j );
+      }
+    }
+  return out;
+}
+
+template< class ImageType, class ComputationType >
+SEXP ripmmarcHelper(
+  SEXP r_image,
+  SEXP r_mask,
+  SEXP r_patchRadius,
+  SEXP r_patchSamples,
+  SEXP r_patchVarEx,
+  SEXP r_meanCenter,
+  SEXP r_rotationInvariant,
+  SEXP r_evecBasis,
+  SEXP r_canonicalFrame,
+  SEXP r_basisFile,
+  SEXP r_outputBasisFile,
+  SEXP r_randomizedSVD,
+  SEXP r_streamingChunkSize,
+  SEXP r_cacheOrientationFrames,
+  SEXP r_verbose )
+{
+  typedef typename ImageType::Pointer ImagePointerType;
+  typedef itk::RIPMMARCImageFilter< ImageType, ImageType, ComputationType > FilterType;
+  typedef typename FilterType::vnlMatrixType MatrixType;
+
+  ImagePointerType image = Rcpp::as< ImagePointerType >( r_image );
+  ImagePointerType mask = Rcpp::as< ImagePointerType >( r_mask );
+
+  typename FilterType::Pointer filter = FilterType::New();
+  filter->SetInput( image );
+  filter->SetMaskImage( mask );
+  filter->SetPatchRadius( Rcpp::as< float >( r_patchRadius ) );
+  filter->SetNumberOfSamplePatches( Rcpp::as< unsigned int >( r_patchSamples ) );
+  filter->SetTargetVarianceExplained( Rcpp::as< float >( r_patchVarEx ) );
+  filter->SetMeanCenterPatches( Rcpp::as< bool >( r_meanCenter ) );
+  filter->SetRotationInvariant( Rcpp::as< bool >( r_rotationInvariant ) );
+  filter->SetRandomizedSVD( Rcpp::as< bool >( r_randomizedSVD ) );
+  filter->SetStreamingChunkSize(
+    Rcpp::as< unsigned long >( r_streamingChunkSize ) );
+  filter->SetCacheOrientationFrames(
+    Rcpp::as< bool >( r_cacheOrientationFrames ) );
+  filter->SetVerbose( Rcpp::as< bool >( r_verbose ) );
+  if ( !Rf_isNull( r_evecBasis ) )
+    {
+    Rcpp::NumericMatrix basis( r_evecBasis );
+    MatrixType eigenvectors( basis.nrow(), basis.ncol() );
+    for ( int i = 0; i < basis.nrow(); i++ )
+      {
+      for ( int j = 0; j < basis.ncol(); j++ )
+        {
+        eigenvectors( i, j ) = basis( i, j );
+        }
+      }
+    filter->SetSignificantPatchEigenvectors( eigenvectors );
+    filter->SetLearnPatchBasis( false );
+    }
+  // a saved basis also fixes the radius and the flags
+  if ( !Rf_isNull( r_basisFile ) )
+    {
+    filter->ReadEigenPatchBasis( Rcpp::as< std::string >( r_basisFile ) );
+    }
+  if ( !Rf_isNull( r_canonicalFrame ) )
+    {
+    ImagePointerType canonicalFrame = Rcpp::as< ImagePointerType >( r_canonicalFrame );
+    filter->SetCanonicalFrame( canonicalFrame );
+    }
+  filter->Update();
+  if ( !Rf_isNull( r_outputBasisFile ) )
+    {
+    filter->WriteEigenPatchBasis( Rcpp::as< std::string >( r_outputBasisFile ) );
+    }
+
+  Rcpp::List out = Rcpp::List::create(
+    Rcpp::Named( "eigenPatches" ) =
+      ripmmarcMatrixToR( filter->GetSignificantPatchEigenvectors() ),
+    Rcpp::Named( "eigenvectorCoefficients" ) =
+      ripmmarcMatrixToR( filter->GetEigenvectorCoefficients() ),
+    Rcpp::Named( "achievedVarianceExplained" ) =
+      filter->GetAchievedVarianceExplained() );
+  // seconds per phase of the update; a phase that did not run is zero
+  const itk::TimeProbesCollectorBase & phaseTimes = filter->GetPhaseTimes();
+  const char * phases[] = { "sample", "learn", "extract", "reorient", "project" };
+  Rcpp::NumericVector seconds( 5 );
+  Rcpp::CharacterVector names( 5 );
+  for ( unsigned int k = 0; k < 5; k++ )
+    {
+    names[ k ] = phases[ k ];
+    try
+      {
+      seconds[ k ] = phaseTimes.GetProbe( phases[ k ] ).GetTotal();
+      }
+    catch( itk::ExceptionObject & )
+      {
+      seconds[ k ] = 0;
+      }
+    }
+  seconds.attr( "names" ) = names;
+  out[ "phaseTimes" ] = seconds;
+  if ( filter->GetCanonicalFrame() )
+    {
+    ImagePointerType canonicalFrame = filter->GetCanonicalFrame();
+    out[ "canonicalFrame" ] = Rcpp::wrap( canonicalFrame );
+    }
+  return out;
+}
+
+template< class ImageType >
+SEXP ripmmarcPrecision(
+  std::string precision,
+  SEXP r_image,
+  SEXP r_mask,
+  SEXP r_patchRadius,
+  SEXP r_patchSamples,
+  SEXP r_patchVarEx,
+  SEXP r_meanCenter,
+  SEXP r_rotationInvariant,
+  SEXP r_evecBasis,
+  SEXP r_canonicalFrame,
+  SEXP r_basisFile,
+  SEXP r_outputBasisFile,
+  SEXP r_randomizedSVD,
+  SEXP r_streamingChunkSize,
+  SEXP r_cacheOrientationFrames,
+  SEXP r_verbose )
+{
+  if ( precision == "float" )
+    {
+    return ripmmarcHelper< ImageType, float >( r_image, r_mask,
+      r_patchRadius, r_patchSamples, r_patchVarEx, r_meanCenter,
+      r_rotationInvariant, r_evecBasis, r_canonicalFrame, r_basisFile,
+      r_outputBasisFile, r_randomizedSVD, r_streamingChunkSize,
+      r_cacheOrientationFrames, r_verbose );
+    }
+  else if ( precision == "double" )
+    {
+    return ripmmarcHelper< ImageType, double >( r_image, r_mask,
+      r_patchRadius, r_patchSamples, r_patchVarEx, r_meanCenter,
+      r_rotationInvariant, r_evecBasis, r_canonicalFrame, r_basisFile,
+      r_outputBasisFile, r_randomizedSVD, r_streamingChunkSize,
+      r_cacheOrientationFrames, r_verbose );
+    }
+  Rcpp::stop( "Unsupported precision" );
+  return Rcpp::wrap( NA_REAL );
+}
+
+RcppExport SEXP RIPMMARC( SEXP r_image, SEXP r_mask, SEXP r_patchRadius,
+  SEXP r_patchSamples, SEXP r_patchVarEx, SEXP r_meanCenter,
+  SEXP r_rotationInvariant, SEXP r_evecBasis, SEXP r_canonicalFrame,
+  SEXP r_basisFile, SEXP r_outputBasisFile, SEXP r_precision,
+  SEXP r_randomizedSVD, SEXP r_streamingChunkSize,
+  SEXP r_cacheOrientationFrames, SEXP r_verbose )
+{
+try
+{
+  Rcpp::S4 antsimage( r_image );
+  std::string pixeltype = Rcpp::as< std::string >( antsimage.slot( "pixeltype" ) );
+  unsigned int dimension = Rcpp::as< int >( antsimage.slot( "dimension" ) );
+  std::string precision = Rcpp::as< std::string >( r_precision );
+
+  if ( ( pixeltype == "float" ) & ( dimension == 2 ) )
+    {
+    typedef itk::Image< float, 2 > ImageType;
+    return ripmmarcPrecision< ImageType >( precision, r_image, r_mask,
+      r_patchRadius, r_patchSamples, r_patchVarEx, r_meanCenter,
+      r_rotationInvariant, r_evecBasis, r_canonicalFrame, r_basisFile,
+      r_outputBasisFile, r_randomizedSVD, r_streamingChunkSize,
+      r_cacheOrientationFrames, r_verbose );
+    }
+  else if ( ( pixeltype == "float" ) & ( dimension == 3 ) )
+    {
+    typedef itk::Image< float, 3 > ImageType;
+    return ripmmarcPrecision< ImageType >( precision, r_image, r_mask,
+      r_patchRadius, r_patchSamples, r_patchVarEx, r_meanCenter,
+      r_rotationInvariant, r_evecBasis, r_canonicalFrame, r_basisFile,
+      r_outputBasisFile, r_randomizedSVD, r_streamingChunkSize,
+      r_cacheOrientationFrames, r_verbose );
+    }
+  else
+    {
+    Rcpp::stop( "Unsupported image dimension or pixel type" );
+    }
+}
+catch( itk::ExceptionObject & err )
+  {
+  Rcpp::Rcout << "ITK ExceptionObject caught !" << std::endl;
+  forward_exception_to_r( err );
+  }
+catch( const std::exception& exc )
+  {
+  Rcpp::Rcout << "STD ExceptionObject caught !" << std::endl;
+  forward_exception_to_r( exc );
+  }
+catch(...)
+  {
+	Rcpp::stop("c++ exception (unknown reason)");
+  }
+return Rcpp::wrap(NA_REAL); //not reached
+}
@@ -0,0 +1,273 @@
+#ifndef eigenPatchBasis_h
+#define eigenPatchBasis_h
+
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "vnl/vnl_matrix.h"
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/** Eigenpatch basis file.  The header is followed by the sphere index
+ * table, one uint32 neighborhood offset per patch row, and by the basis,
+ * patch rows by eigenpatch columns in row-major order, starting on a 64
+ * byte boundary.  The basis is thus laid out as a vnl_matrix and a mapped
+ * file is used in place.  Values are in the byte order of the writer;
+ * byteOrder tells a reader on another architecture to reject the file. */
+struct eigenPatchBasisHeader
+{
+  char     magic[8];
+  uint32_t version;
+  uint32_t byteOrder;
+  uint32_t dimension;
+  uint32_t scalarSize;
+  uint32_t flags;
+  uint32_t reserved;
+  double   radius;
+  uint64_t numberOfIndices;
+  uint64_t numberOfEigenPatches;
+  uint64_t indexOffset;
+  uint64_t basisOffset;
+};
+
+static const char     eigenPatchBasisMagic[8] = { 'A', 'N', 'T', 's', 'E', 'P', 'B', '\0' };
+static const uint32_t eigenPatchBasisVersion = 1;
+static const uint32_t eigenPatchBasisByteOrder = 0x01020304;
+static const uint32_t eigenPatchBasisMeanCenter = 1;
+static const uint32_t eigenPatchBasisRotationInvariant = 2;
+
+/** Write basis (patch rows x eigenpatch columns) with the patch geometry
+ * it was learnt for. */
+template< class T >
+void eigenPatchBasisWrite(
+  const std::string & fileName,
+  unsigned int dimension,
+  double radius,
+  bool meanCenter,
+  bool rotationInvariant,
+  const std::vector< unsigned int > & indicesWithinSphere,
+  const vnl_matrix< T > & basis )
+{
+  if ( indicesWithinSphere.size() != basis.rows() )
+    {
+    throw std::runtime_error( "eigenpatch basis rows do not match the sphere index table" );
+    }
+  eigenPatchBasisHeader header;
+  std::memset( &header, 0, sizeof( header ) );
+  std::memcpy( header.magic, eigenPatchBasisMagic, sizeof( header.magic ) );
+  header.version = eigenPatchBasisVersion;
+  header.byteOrder = eigenPatchBasisByteOrder;
+  header.dimension = dimension;
+  header.scalarSize = sizeof( T );
+  header.flags = ( meanCenter ? eigenPatchBasisMeanCenter : 0 ) |
+    ( rotationInvariant ? eigenPatchBasisRotationInvariant : 0 );
+  header.radius = radius;
+  header.numberOfIndices = basis.rows();
+  header.numberOfEigenPatches = basis.cols();
+  header.indexOffset = sizeof( header );
+  const uint64_t indexEnd = header.indexOffset +
+    header.numberOfIndices * sizeof( uint32_t );
+  header.basisOffset = ( indexEnd + 63 ) / 64 * 64;
+
+  std::ofstream file( fileName.c_str(), std::ios::binary | std::ios::trunc );
+  if ( !file )
+    {
+    throw std::runtime_error( "cannot open " + fileName + " for writing" );
+    }
+  file.write( reinterpret_cast< const char * >( &header ), sizeof( header ) );
+  std::vector< uint32_t > indices( indicesWithinSphere.begin(), indicesWithinSphere.end() );
+  if ( !indices.empty() )
+    {
+    file.write( reinterpret_cast< const char * >( &indices[0] ),
+      indices.size() * sizeof( uint32_t ) );
+    }
+  const std::vector< char > padding( header.basisOffset - indexEnd, 0 );
+  if ( !padding.empty() )
+    {
+    file.write( &padding[0], padding.size() );
+    }
+  if ( basis.size() > 0 )
+    {
+    file.write( reinterpret_cast< const char * >( basis.data_block() ),
+      basis.size() * sizeof( T ) );
+    }
+  if ( !file )
+    {
+    throw std::runtime_error( "failed writing " + fileName );
+    }
+}
+
+/** A read-only view of an eigenpatch basis file.  The file is mapped, so
+ * every process that opens the same basis shares its pages; where mmap is
+ * not available the file is read into memory instead. */
+class eigenPatchBasisMap
+{
+public:
+  explicit eigenPatchBasisMap( const std::string & fileName ) :
+    m_Data( NULL ), m_Size( 0 ), m_Mapped( false )
+  {
+#ifndef _WIN32
+    const int descriptor = open( fileName.c_str(), O_RDONLY );
+    if ( descriptor < 0 )
+      {
+      throw std::runtime_error( "cannot open " + fileName );
+      }
+    struct stat status;
+    if ( fstat( descriptor, &status ) != 0 )
+      {
+      close( descriptor );
+      throw std::runtime_error( "cannot stat " + fileName );
+      }
+    this->m_Size = status.st_size;
+    if ( this->m_Size >= sizeof( eigenPatchBasisHeader ) )
+      {
+      void * data = mmap( NULL, this->m_Size, PROT_READ, MAP_SHARED, descriptor, 0 );
+      if ( data != MAP_FAILED )
+        {
+        this->m_Data = static_cast< const char * >( data );
+        this->m_Mapped = true;
+        }
+      }
+    close( descriptor );
+#endif
+    if ( !this->m_Mapped )
+      {
+      std::ifstream file( fileName.c_str(), std::ios::binary );
+      if ( !file )
+        {
+        throw std::runtime_error( "cannot open " + fileName );
+        }
+      this->m_Buffer.assign( std::istreambuf_iterator< char >( file ),
+        std::istreambuf_iterator< char >() );
+      this->m_Size = this->m_Buffer.size();
+      this->m_Data = this->m_Buffer.empty() ? NULL : &this->m_Buffer[0];
+      }
+    try
+      {
+      this->Validate( fileName );
+      }
+    catch ( ... )
+      {
+      this->Unmap();
+      throw;
+      }
+  }
+
+  ~eigenPatchBasisMap()
+  {
+    this->Unmap();
+  }
+
+  const eigenPatchBasisHeader & Header() const
+  {
+    return *reinterpret_cast< const eigenPatchBasisHeader * >( this->m_Data );
+  }
+
+  bool MeanCenter() const
+  {
+    return ( this->Header().flags & eigenPatchBasisMeanCenter ) != 0;
+  }
+
+  bool RotationInvariant() const
+  {
+    return ( this->Header().flags & eigenPatchBasisRotationInvariant ) != 0;
+  }
+
+  const uint32_t * Indices() const
+  {
+    return reinterpret_cast< const uint32_t * >( this->m_Data + this->Header().indexOffset );
+  }
+
+  /** The basis in place, or NULL if it was written with another scalar type. */
+  template< class T >
+  const T * Basis() const
+  {
+    if ( this->Header().scalarSize != sizeof( T ) )
+      {
+      return NULL;
+      }
+    return reinterpret_cast< const T * >( this->m_Data + this->Header().basisOffset );
+  }
+
+  /** A copy of the basis converted to T. */
+  template< class T >
+  vnl_matrix< T > BasisCopy() const
+  {
+    const eigenPatchBasisHeader & header = this->Header();
+    vnl_matrix< T > basis( header.numberOfIndices, header.numberOfEigenPatches );
+    const char * data = this->m_Data + header.basisOffset;
+    for ( unsigned int i = 0; i < basis.size(); i++ )
+      {
+      if ( header.scalarSize == sizeof( float ) )
+        {
+        basis.data_block()[i] = reinterpret_cast< const float * >( data )[i];
+        }
+      else
+        {
+        basis.data_block()[i] = reinterpret_cast< const double * >( data )[i];
+        }
+      }
+    return basis;
+  }
+
+private:
+  eigenPatchBasisMap( const eigenPatchBasisMap & );
+  void operator=( const eigenPatchBasisMap & );
+
+  void Unmap()
+  {
+#ifndef _WIN32
+    if ( this->m_Mapped )
+      {
+      munmap( const_cast< char * >( this->m_Data ), this->m_Size );
+      this->m_Mapped = false;
+      }
+#endif
+  }
+
+  void Validate( const std::string & fileName ) const
+  {
+    if ( this->m_Size < sizeof( eigenPatchBasisHeader ) ||
+         std::memcmp( this->Header().magic, eigenPatchBasisMagic,
+           sizeof( eigenPatchBasisMagic ) ) != 0 )
+      {
+      throw std::runtime_error( fileName + " is not an eigenpatch basis file" );
+      }
+    const eigenPatchBasisHeader & header = this->Header();
+    if ( header.byteOrder != eigenPatchBasisByteOrder )
+      {
+      throw std::runtime_error( fileName + " was written with another byte order" );
+      }
+    if ( header.version != eigenPatchBasisVersion )
+      {
+      throw std::runtime_error( fileName + " has an unsupported basis format version" );
+      }
+    if ( header.scalarSize != sizeof( float ) && header.scalarSize != sizeof( double ) )
+      {
+      throw std::runtime_error( fileName + " has an unsupported scalar type" );
+      }
+    if ( header.indexOffset + header.numberOfIndices * sizeof( uint32_t ) > header.basisOffset ||
+         header.basisOffset % 64 != 0 ||
+         header.basisOffset + header.numberOfIndices * header.numberOfEigenPatches *
+           header.scalarSize > this->m_Size )
+      {
+      throw std::runtime_error( fileName + " is truncated or corrupt" );
+      }
+  }
+
+  const char *       m_Data;
+  size_t             m_Size;
+  bool               m_Mapped;
+  std::vector< char > m_Buffer;
+};
+
+#endif
@@ -16,21 +16,24 @@ extern SEXP antsMotionCorr(SEXP);
 extern SEXP antsMotionCorrStats(SEXP, SEXP, SEXP, SEXP);
 extern SEXP centerOfMass(SEXP);
 extern SEXP createJacobianDeterminantImageR(SEXP, SEXP, SEXP, SEXP);
-extern SEXP eigenanatomyCpp(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP eigenanatomyCpp(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
 extern SEXP fastMarchingExtension(SEXP, SEXP, SEXP);
 extern SEXP fitBsplineObjectToScatteredData(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
 extern SEXP fitBsplineDisplacementField(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
 extern SEXP fsl2antsrTransform(SEXP, SEXP, SEXP, SEXP);
 extern SEXP histogramMatchImageR(SEXP, SEXP, SEXP, SEXP, SEXP);
-extern SEXP invariantImageSimilarity(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
-extern SEXP itkConvolveImage(SEXP, SEXP);
+extern SEXP invariantImageSimilarity(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP invariantImageSimilarityBatch(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP invariantImageSimilarityFixedContext(SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP itkConvolveImage(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
 extern SEXP KellyKapowski(SEXP);
 extern SEXP LabelGeometryMeasures(SEXP);
 extern SEXP labelOverlapMeasuresR(SEXP, SEXP);
 extern SEXP reflectionMatrix(SEXP, SEXP, SEXP, SEXP);
 extern SEXP reorientImage(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP RIPMMARC(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
 extern SEXP robustMatrixTransform(SEXP);
-extern SEXP sccanCpp(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+extern SEXP sccanCpp(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
 extern SEXP sccanX(SEXP);
 extern SEXP simulateBSplineDisplacementFieldR(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
 extern SEXP simulateExponentialDisplacementFieldR(SEXP, SEXP, SEXP, SEXP, SEXP);
@@ -44,21 +47,24 @@ static const R_CallMethodDef CallEntries[] = {
     {"antsMotionCorrStats",                     (DL_FUNC) &antsMotionCorrStats,                    4},
     {"centerOfMass",                            (DL_FUNC) &centerOfMass,                           1},
     {"createJacobianDeterminantImageR",         (DL_FUNC) &createJacobianDeterminantImageR,        4},
-    {"eigenanatomyCpp",                         (DL_FUNC) &eigenanatomyCpp,                       15},
+    {"eigenanatomyCpp",                         (DL_FUNC) &eigenanatomyCpp,                       18},
     {"fastMarchingExtension",                   (DL_FUNC) &fastMarchingExtension,                  3},
     {"fitBsplineObjectToScatteredData",         (DL_FUNC) &fitBsplineObjectToScatteredData,       10},
     {"fitBsplineDisplacementField",             (DL_FUNC) &fitBsplineDisplacementField,           15},
     {"fsl2antsrTransform",                      (DL_FUNC) &fsl2antsrTransform,                     4},
     {"histogramMatchImageR",                    (DL_FUNC) &histogramMatchImageR,                   5},
-    {"invariantImageSimilarity",                (DL_FUNC) &invariantImageSimilarity,              12},
-    {"itkConvolveImage",                        (DL_FUNC) &itkConvolveImage,                       2},
+    {"invariantImageSimilarity",                (DL_FUNC) &invariantImageSimilarity,              20},
+    {"invariantImageSimilarityBatch",           (DL_FUNC) &invariantImageSimilarityBatch,         20},
+    {"invariantImageSimilarityFixedContext",    (DL_FUNC) &invariantImageSimilarityFixedContext,   5},
+    {"itkConvolveImage",                        (DL_FUNC) &itkConvolveImage,                       6},
     {"KellyKapowski",                           (DL_FUNC) &KellyKapowski,                          1},
     {"LabelGeometryMeasures",                   (DL_FUNC) &LabelGeometryMeasures,                  1},
     {"labelOverlapMeasuresR",                   (DL_FUNC) &labelOverlapMeasuresR,                  2},
     {"reflectionMatrix",                        (DL_FUNC) &reflectionMatrix,                       4},
     {"reorientImage",                           (DL_FUNC) &reorientImage,                          6},
+    {"RIPMMARC",                                (DL_FUNC) &RIPMMARC,                              16},
     {"robustMatrixTransform",                   (DL_FUNC) &robustMatrixTransform,                  1},
-    {"sccanCpp",                                (DL_FUNC) &sccanCpp,                              19},
+    {"sccanCpp",                                (DL_FUNC) &sccanCpp,                              23},
     {"sccanX",                                  (DL_FUNC) &sccanX,                                 1},
     {"simulateBSplineDisplacementFieldR",       (DL_FUNC) &simulateBSplineDisplacementFieldR,      6},
     {"simulateExponentialDisplacementFieldR",   (DL_FUNC) &simulateExponentialDisplacementFieldR,  5},
@@ -21,6 +21,7 @@
 #include "itkConjugateGradientLineSearchOptimizerv4.h"
 #include "itkConnectedComponentImageFilter.h"
 #include "itkConstNeighborhoodIterator.h"
+#include "itkConstantBoundaryCondition.h"
 #include "itkConvolutionImageFilter.h"
 #include "itkCorrelationImageToImageMetricv4.h"
 #include "itkDiscreteGaussianImageFilter.h"
@@ -29,6 +30,7 @@
 #include "itkDemonsImageToImageMetricv4.h"
 #include "itkExpImageFilter.h"
 #include "itkExtractImageFilter.h"
+#include "itkFFTConvolutionImageFilter.h"
 #include "itkGaussianImageSource.h"
 #include "itkGradientAnisotropicDiffusionImageFilter.h"
 #include "itkGradientMagnitudeRecursiveGaussianImageFilter.h"
@@ -51,15 +53,19 @@
 #include "itkLabelContourImageFilter.h"
 #include "itkLabelStatisticsImageFilter.h"
 #include "itkLaplacianRecursiveGaussianImageFilter.h"
+#include "itkLinearInterpolateImageFunction.h"
 #include "itkListSample.h"
 #include "itkMRFImageFilter.h"
 #include "itkMRIBiasFieldCorrectionFilter.h"
 #include "itkMaskImageFilter.h"
+#include "itkMaskedFFTNormalizedCorrelationImageFilter.h"
 #include "itkMaximumImageFilter.h"
 #include "itkMedianImageFilter.h"
+#include "itkMinimumMaximumImageCalculator.h"
 #include "itkMultiplyImageFilter.h"
 #include "itkMultivariateLegendrePolynomial.h"
 #include "itkMultiStartOptimizerv4.h"
+#include "itkMultiThreaderBase.h"
 #include "itkNeighborhood.h"
 #include "itkNeighborhoodAlgorithm.h"
 #include "itkNeighborhoodIterator.h"
@@ -69,6 +75,7 @@
 #include "itkRGBPixel.h"
 #include "itkRegistrationParameterScalesFromPhysicalShift.h"
 #include "itkRelabelComponentImageFilter.h"
+#include "itkResampleImageFilter.h"
 #include "itkRescaleIntensityImageFilter.h"
 #include "itkSampleToHistogramFilter.h"
 #include "itkScalarImageKmeansImageFilter.h"
@@ -89,9 +96,15 @@
 #include "itkCenteredAffineTransform.h"
 #include "itkCompositeTransform.h"
 
+#include <atomic>
+#include <cmath>
 #include <fstream>
 #include <iostream>
+#include <limits>
 #include <map> // Here I'm using a map but you could choose even other containers
+#include <mutex>
+#include <numeric>
+#include <random>
 #include <sstream>
 #include <string>
 
@@ -134,394 +147,1448 @@ public:
 };
 
 
-template< unsigned int ImageDimension, class AffineType >
-SEXP invariantSimilarityHelper(
+template< class TMetric >
+void invariantSimilarityConfigureMetric( TMetric *, unsigned int )
+{
+}
+
+template< class TImage >
+void invariantSimilarityConfigureMetric(
+  itk::MattesMutualInformationImageToImageMetricv4<TImage, TImage, TImage> *
+    metric, unsigned int mibins )
+{
+  metric->SetNumberOfHistogramBins( mibins );
+}
+
+template< class TMetric, class TImage, class TTransform, class TMask,
+  class TPointSet >
+typename TMetric::Pointer invariantSimilarityCreateMetric(
+  const TImage * fixedImage, const TImage * movingImage,
+  TTransform * transform, TMask * mask, TPointSet * pset,
+  unsigned int mibins )
+{
+  typename TMetric::Pointer metric = TMetric::New();
+  invariantSimilarityConfigureMetric( metric.GetPointer(), mibins );
+  metric->SetFixedImage( fixedImage );
+  metric->SetVirtualDomainFromImage( fixedImage );
+  metric->SetMovingImage( movingImage );
+  metric->SetMovingTransform( transform );
+  if ( mask != nullptr )
+    {
+    metric->SetFixedImageMask( mask );
+    }
+  metric->SetFixedSampledPointSet( pset );
+  metric->SetUseSampledPointSet( true );
+  metric->Initialize();
+  return metric;
+}
+
+inline itk::ConjugateGradientLineSearchOptimizerv4::Pointer
+invariantSimilarityCreateLocalOptimizer( unsigned int localSearchIterations )
+{
+  typedef itk::ConjugateGradientLineSearchOptimizerv4 LocalOptimizerType;
+  LocalOptimizerType::Pointer localoptimizer = LocalOptimizerType::New();
+  double localoptimizerlearningrate = 0.1;
+  localoptimizer->SetLearningRate( localoptimizerlearningrate );
+  localoptimizer->SetMaximumStepSizeInPhysicalUnits(
+    localoptimizerlearningrate );
+  localoptimizer->SetNumberOfIterations( localSearchIterations );
+  localoptimizer->SetLowerLimit( 0 );
+  localoptimizer->SetUpperLimit( 2 );
+  localoptimizer->SetEpsilon( 0.1 );
+  localoptimizer->SetMaximumLineSearchIterations( 50 );
+  localoptimizer->SetDoEstimateLearningRateOnce( true );
+  localoptimizer->SetMinimumConvergenceValue( 1.e-6 );
+  localoptimizer->SetConvergenceWindowSize( 5 );
+  return localoptimizer;
+}
+
+/** Run worker( nextItem ) on min( numberOfItems, threads ) threads.  The
+ * workers claim items 0 .. numberOfItems - 1 by incrementing nextItem, so
+ * uneven items still balance.  The first exception thrown by a worker is
+ * rethrown once all of them have finished. */
+template< class TWorker >
+void invariantSimilarityRunWorkers( unsigned int numberOfItems,
+  TWorker worker )
+{
+  if ( numberOfItems == 0 )
+    {
+    return;
+    }
+  const unsigned int numberOfWorkers = std::max< unsigned int >( 1,
+    std::min< unsigned int >( numberOfItems,
+      itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads() ) );
+  std::atomic< unsigned int > nextItem( 0 );
+  std::exception_ptr workerError = nullptr;
+  std::mutex workerErrorMutex;
+  auto run = [&]( itk::SizeValueType )
+    {
+    try
+      {
+      worker( nextItem );
+      }
+    catch( ... )
+      {
+      std::lock_guard< std::mutex > lock( workerErrorMutex );
+      if ( !workerError )
+        {
+        workerError = std::current_exception();
+        }
+      }
+    };
+  itk::MultiThreaderBase::Pointer threader = itk::MultiThreaderBase::New();
+  threader->SetNumberOfWorkUnits( numberOfWorkers );
+  threader->ParallelizeArray( 0, numberOfWorkers, run, nullptr );
+  if ( workerError )
+    {
+    std::rethrow_exception( workerError );
+    }
+}
+
+/** Settings of the search that do not depend on the images.  A start is
+ * pruned, i.e. keeps its initial parameters without local search, when its
+ * initial metric is worse than the m_PruneQuantile quantile of its image's
+ * initial values, or worse by more than m_PruneMargin than the best start
+ * of its image optimized so far. */
+struct InvariantSimilaritySearchOptions
+{
+  std::string   m_Metric;
+  unsigned int  m_LocalSearchIterations;
+  unsigned int  m_TopK;
+  bool          m_FFTTranslation;
+  double        m_PruneQuantile;
+  double        m_PruneMargin;
+  bool          m_LeanEvaluator;
+};
+
+inline InvariantSimilaritySearchOptions invariantSimilarityReadOptions(
+  SEXP r_WM, SEXP r_lsits, SEXP r_topK, SEXP r_fftTranslation,
+  SEXP r_pruning, SEXP r_leanEvaluator )
+{
+  InvariantSimilaritySearchOptions options;
+  options.m_Metric = Rcpp::as< std::string >( r_WM );
+  options.m_LocalSearchIterations = Rcpp::as< unsigned int >( r_lsits );
+  options.m_TopK = Rcpp::as< unsigned int >( r_topK );
+  options.m_FFTTranslation = Rcpp::as< bool >( r_fftTranslation );
+  // c( quantile, margin )
+  Rcpp::NumericVector pruning( r_pruning );
+  options.m_PruneQuantile = pruning.size() > 0 ? pruning[ 0 ] : 1.0;
+  options.m_PruneMargin = pruning.size() > 1 ? pruning[ 1 ] :
+    std::numeric_limits< double >::infinity();
+  options.m_LeanEvaluator = Rcpp::as< bool >( r_leanEvaluator );
+  return options;
+}
+
+/** The starts searched for one moving image.  m_MovingLevel is the moving
+ * image at the level being searched and m_StartIndices maps the surviving
+ * starts back to the rotation they came from.  m_Iterations counts the
+ * local search iterations each start ran over all levels. */
+template< class TImage, class TAffine >
+class InvariantSimilarityStarts
+{
+public:
+  typedef typename TAffine::ParametersType  ParametersType;
+
+  InvariantSimilarityStarts() : m_NumberOfPrunedStarts( 0 ) {}
+
+  typename TImage::Pointer                  m_MovingImage;
+  typename TImage::Pointer                  m_MovingLevel;
+  typename TAffine::InputPointType          m_Center;
+  ParametersType                            m_InitialParameters;
+  std::vector< ParametersType >             m_Parameters;
+  std::vector< double >                     m_MetricValues;
+  std::vector< unsigned int >               m_StartIndices;
+  std::vector< unsigned int >               m_Iterations;
+  unsigned int                              m_NumberOfPrunedStarts;
+};
+
+/** The correlation metric for scoring starts without local search.  The
+ * fixed samples that pass the fixed mask are flattened once into
+ * contiguous coordinate and value arrays.  Scoring a start then maps them
+ * straight to moving image continuous indices and interpolates linearly,
+ * without touching the heap.  The value is that of
+ * CorrelationImageToImageMetricv4, minus the squared normalized cross
+ * correlation over the samples that land inside the moving image. */
+template< class TImage >
+class InvariantSimilarityCorrelationEvaluator
+{
+public:
+  enum { ImageDimension = TImage::ImageDimension };
+  typedef itk::Matrix< double, ImageDimension, ImageDimension > MatrixType;
+  typedef itk::Vector< double, ImageDimension >                 VectorType;
+
+  template< class TMaskImage, class TPointSet >
+  void Initialize( const TImage * fixedImage, const TMaskImage * mask,
+    const TPointSet * pset )
+  {
+    typedef itk::LinearInterpolateImageFunction< TImage, double >
+      InterpolatorType;
+    typename InterpolatorType::Pointer interpolator =
+      InterpolatorType::New();
+    interpolator->SetInputImage( fixedImage );
+    m_Points.clear();
+    m_FixedValues.clear();
+    for ( typename TPointSet::PointIdentifier k = 0;
+          k < pset->GetNumberOfPoints(); k++ )
+      {
+      typename TPointSet::PointType point = pset->GetPoint( k );
+      if ( mask != nullptr )
+        {
+        typename TMaskImage::IndexType maskIndex;
+        if ( !mask->TransformPhysicalPointToIndex( point, maskIndex ) ||
+             mask->GetPixel( maskIndex ) == 0 )
+          {
+          continue;
+          }
+        }
+      if ( !interpolator->IsInsideBuffer( point ) )
+        {
+        continue;
+        }
+      for ( unsigned int d = 0; d < ImageDimension; d++ )
+        {
+        m_Points.push_back( point[ d ] );
+        }
+      m_FixedValues.push_back( interpolator->Evaluate( point ) );
+      }
+  }
+
+  /** Score the transform x -> matrix * x + offset. */
+  double Evaluate( const TImage * movingImage, const MatrixType & matrix,
+    const VectorType & offset ) const
+  {
+    // fold physical to continuous index into the transform
+    MatrixType indexToPhysical;
+    for ( unsigned int i = 0; i < ImageDimension; i++ )
+      {
+      for ( unsigned int j = 0; j < ImageDimension; j++ )
+        {
+        indexToPhysical( i, j ) = movingImage->GetDirection()( i, j ) *
+          movingImage->GetSpacing()[ j ];
+        }
+      }
+    MatrixType physicalToIndex( indexToPhysical.GetInverse() );
+    MatrixType A = physicalToIndex * matrix;
+    VectorType t;
+    for ( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      t[ d ] = offset[ d ] - movingImage->GetOrigin()[ d ];
+      }
+    t = physicalToIndex * t;
+    const typename TImage::RegionType region =
+      movingImage->GetBufferedRegion();
+    const typename TImage::PixelType * buffer =
+      movingImage->GetBufferPointer();
+    long start[ ImageDimension ];
+    long last[ ImageDimension ];
+    unsigned long stride[ ImageDimension ];
+    unsigned long s = 1;
+    for ( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      start[ d ] = region.GetIndex()[ d ];
+      last[ d ] = start[ d ] + static_cast< long >( region.GetSize()[ d ] ) - 1;
+      stride[ d ] = s;
+      s *= region.GetSize()[ d ];
+      }
+    double sf = 0, sm = 0, sff = 0, smm = 0, sfm = 0;
+    unsigned long n = 0;
+    const unsigned long numberOfPoints = m_FixedValues.size();
+    for ( unsigned long k = 0; k < numberOfPoints; k++ )
+      {
+      const double * x = &m_Points[ k * ImageDimension ];
+      long base[ ImageDimension ];
+      double frac[ ImageDimension ];
+      bool inside = true;
+      for ( unsigned int i = 0; i < ImageDimension && inside; i++ )
+        {
+        double ci = t[ i ];
+        for ( unsigned int j = 0; j < ImageDimension; j++ )
+          {
+          ci += A( i, j ) * x[ j ];
+          }
+        // same extent as InterpolateImageFunction::IsInsideBuffer
+        if ( ci < start[ i ] - 0.5 || ci >= last[ i ] + 0.5 )
+          {
+          inside = false;
+          }
+        base[ i ] = static_cast< long >( std::floor( ci ) );
+        frac[ i ] = ci - base[ i ];
+        }
+      if ( !inside )
+        {
+        continue;
+        }
+      double m = 0;
+      for ( unsigned int corner = 0; corner < ( 1u << ImageDimension );
+            corner++ )
+        {
+        double w = 1;
+        unsigned long offsetInBuffer = 0;
+        for ( unsigned int d = 0; d < ImageDimension; d++ )
+          {
+          long index = base[ d ];
+          if ( corner & ( 1u << d ) )
+            {
+            w *= frac[ d ];
+            index++;
+            }
+          else
+            {
+            w *= 1.0 - frac[ d ];
+            }
+          index = std::min( last[ d ], std::max( start[ d ], index ) );
+          offsetInBuffer += ( index - start[ d ] ) * stride[ d ];
+          }
+        m += w * buffer[ offsetInBuffer ];
+        }
+      const double f = m_FixedValues[ k ];
+      sf += f;
+      sm += m;
+      sff += f * f;
+      smm += m * m;
+      sfm += f * m;
+      n++;
+      }
+    if ( n == 0 )
+      {
+      return itk::NumericTraits< double >::max();
+      }
+    const double fm = sfm - sf * sm / n;
+    const double ff = sff - sf * sf / n;
+    const double mm = smm - sm * sm / n;
+    if ( ff <= 0 || mm <= 0 )
+      {
+      return itk::NumericTraits< double >::max();
+      }
+    return -1.0 * fm * fm / ( ff * mm );
+  }
+
+  unsigned long GetNumberOfSamples() const
+  {
+    return m_FixedValues.size();
+  }
+
+private:
+  std::vector< double > m_Points;
+  std::vector< double > m_FixedValues;
+};
+
+/** Score every start of every image concurrently.  Each worker owns its
+ * own moving transform, metric and local optimizer and rebuilds them when
+ * the next (image, start) pair it claims belongs to another image; the
+ * fixed image, mask and sampled point set are shared between threads and
+ * those are read-only.  When pruning, every start's initial metric is
+ * taken first, each image's best start is then optimized on its own and
+ * the margin test compares the remaining starts against that optimum, so
+ * which starts are pruned does not depend on the order in which the
+ * workers finish.  On return m_Parameters
+ * holds the (locally optimized) parameters and m_MetricValues the metric
+ * at each.  A non-null evaluator, which must match TMetric, replaces the
+ * metric for passes that do no local search. */
+template< class TMetric, class TAffine, class TImage, class TMask,
+  class TPointSet >
+void invariantSimilarityMultiStartSearch(
+  const TImage * fixedImage,
+  TMask * mask,
+  TPointSet * pset,
+  unsigned int mibins,
+  unsigned int localSearchIterations,
+  double pruneQuantile,
+  double pruneMargin,
+  const InvariantSimilarityCorrelationEvaluator< TImage > * evaluator,
+  std::vector< InvariantSimilarityStarts< TImage, TAffine > > & jobs )
+{
+  typedef InvariantSimilarityStarts< TImage, TAffine > StartsType;
+  typedef itk::ConjugateGradientLineSearchOptimizerv4 LocalOptimizerType;
+  typedef itk::RegistrationParameterScalesFromPhysicalShift<TMetric>
+    ScalesEstimatorType;
+  typedef typename ScalesEstimatorType::ScalesType ScalesType;
+  // work item i is start order[ i ] - jobOffsets[ j ] of image j
+  std::vector< unsigned int > jobOffsets( jobs.size() + 1, 0 );
+  for ( unsigned int j = 0; j < jobs.size(); j++ )
+    {
+    jobs[ j ].m_MetricValues.assign( jobs[ j ].m_Parameters.size(),
+      itk::NumericTraits<double>::max() );
+    jobs[ j ].m_Iterations.resize( jobs[ j ].m_Parameters.size(), 0 );
+    jobOffsets[ j + 1 ] = jobOffsets[ j ] + jobs[ j ].m_Parameters.size();
+    }
+  const unsigned int numberOfItems = jobOffsets.back();
+  if ( numberOfItems == 0 )
+    {
+    return;
+    }
+  std::vector< unsigned int > order( numberOfItems );
+  for ( unsigned int i = 0; i < numberOfItems; i++ )
+    {
+    order[ i ] = i;
+    }
+
+  // the scales depend only on the geometry so estimate them once per image
+  std::vector< ScalesType > movingScales( jobs.size() );
+  invariantSimilarityRunWorkers( localSearchIterations > 0 ? jobs.size() : 0,
+    [&]( std::atomic< unsigned int > & nextJob )
+    {
+    for ( unsigned int j = nextJob++; j < jobs.size(); j = nextJob++ )
+      {
+      const StartsType & job = jobs[ j ];
+      if ( job.m_Parameters.empty() )
+        {
+        continue;
+        }
+      typename TAffine::Pointer prototype = TAffine::New();
+      prototype->SetCenter( job.m_Center );
+      prototype->SetParameters( job.m_InitialParameters );
+      typename TMetric::Pointer prototypeMetric =
+        invariantSimilarityCreateMetric<TMetric>( fixedImage,
+          job.m_MovingLevel.GetPointer(), prototype.GetPointer(), mask, pset,
+          mibins );
+      typename ScalesEstimatorType::Pointer shiftScaleEstimator =
+        ScalesEstimatorType::New();
+      shiftScaleEstimator->SetMetric( prototypeMetric );
+      shiftScaleEstimator->SetTransformForward( true );
+      movingScales[ j ].SetSize( prototype->GetNumberOfParameters() );
+      shiftScaleEstimator->EstimateScales( movingScales[ j ] );
+      }
+    } );
+
+  const bool prune = localSearchIterations > 0 &&
+    ( pruneQuantile < 1.0 || pruneMargin < itk::NumericTraits<double>::max() );
+  std::vector< double > pruneThreshold( jobs.size(),
+    itk::NumericTraits<double>::max() );
+  // filled in before the pruned pass and only read during it
+  std::vector< double > bestOptimized( jobs.size(),
+    itk::NumericTraits<double>::max() );
+  std::mutex prunedStartsMutex;
+  // optimize: false scores the starts as they are; starts lists the work
+  // items in the order they are claimed and pruneStarts applies the
+  // quantile and margin tests to them
+  auto search = [&]( bool optimize, const std::vector< unsigned int > & starts,
+    bool pruneStarts )
+    {
+    const unsigned int iterations = optimize ? localSearchIterations : 0;
+    const unsigned int numberOfStarts = starts.size();
+    invariantSimilarityRunWorkers( numberOfStarts,
+      [&]( std::atomic< unsigned int > & nextStart )
+      {
+      unsigned int currentJob = jobs.size();
+      typename TAffine::Pointer transform = nullptr;
+      typename TMetric::Pointer metric = nullptr;
+      typename LocalOptimizerType::Pointer localoptimizer = nullptr;
+      for ( unsigned int i = nextStart++; i < numberOfStarts;
+            i = nextStart++ )
+        {
+        unsigned int j = std::upper_bound( jobOffsets.begin(),
+          jobOffsets.end(), starts[ i ] ) - jobOffsets.begin() - 1;
+        StartsType & job = jobs[ j ];
+        unsigned int k = starts[ i ] - jobOffsets[ j ];
+        if ( pruneStarts )
+          {
+          if ( job.m_MetricValues[ k ] > pruneThreshold[ j ] ||
+               job.m_MetricValues[ k ] > bestOptimized[ j ] + pruneMargin )
+            {
+            // each image's starts are claimed by several workers
+            std::lock_guard< std::mutex > lock( prunedStartsMutex );
+            job.m_NumberOfPrunedStarts++;
+            continue;
+            }
+          }
+        if ( iterations == 0 && evaluator != nullptr )
+          {
+          // lean scoring: one transform per worker and no metric at all
+          if ( transform.IsNull() )
+            {
+            transform = TAffine::New();
+            }
+          if ( j != currentJob )
+            {
+            transform->SetCenter( job.m_Center );
+            currentJob = j;
+            }
+          transform->SetParameters( job.m_Parameters[ k ] );
+          job.m_MetricValues[ k ] = evaluator->Evaluate(
+            job.m_MovingLevel.GetPointer(), transform->GetMatrix(),
+            transform->GetOffset() );
+          continue;
+          }
+        if ( j != currentJob )
+          {
+          transform = TAffine::New();
+          transform->SetCenter( job.m_Center );
+          transform->SetParameters( job.m_InitialParameters );
+          metric = invariantSimilarityCreateMetric<TMetric>( fixedImage,
+            job.m_MovingLevel.GetPointer(), transform.GetPointer(), mask,
+            pset, mibins );
+          // the starts are the unit of parallelism so keep each metric serial
+          metric->SetMaximumNumberOfWorkUnits( 1 );
+          localoptimizer =
+            invariantSimilarityCreateLocalOptimizer( iterations );
+          localoptimizer->SetMetric( metric );
+          localoptimizer->SetScales( movingScales[ j ] );
+          currentJob = j;
+          }
+        metric->SetParameters( job.m_Parameters[ k ] );
+        if ( iterations > 0 )
+          {
+          localoptimizer->StartOptimization();
+          job.m_Parameters[ k ] = metric->GetParameters();
+          job.m_Iterations[ k ] += localoptimizer->GetCurrentIteration();
+          }
+        job.m_MetricValues[ k ] = metric->GetValue();
+        }
+      } );
+    };
+
+  if ( !prune )
+    {
+    search( true, order, false );
+    return;
+    }
+  search( false, order, false );
+  std::vector< unsigned int > bestStarts;
+  for ( unsigned int j = 0; j < jobs.size(); j++ )
+    {
+    const std::vector< double > & values = jobs[ j ].m_MetricValues;
+    if ( values.empty() )
+      {
+      continue;
+      }
+    std::vector< double > sorted( values );
+    std::sort( sorted.begin(), sorted.end() );
+    double q = std::min( 1.0, std::max( 0.0, pruneQuantile ) );
+    pruneThreshold[ j ] = sorted[ static_cast< unsigned int >(
+      q * ( sorted.size() - 1 ) + 0.5 ) ];
+    // best first within each image
+    std::sort( order.begin() + jobOffsets[ j ],
+      order.begin() + jobOffsets[ j + 1 ],
+      [&values, &jobOffsets, j]( unsigned int a, unsigned int b )
+        { return values[ a - jobOffsets[ j ] ] <
+                 values[ b - jobOffsets[ j ] ]; } );
+    bestStarts.push_back( order[ jobOffsets[ j ] ] );
+    }
+  // each image's best start is never pruned and sets its margin
+  search( true, bestStarts, false );
+  std::vector< unsigned int > otherStarts;
+  for ( unsigned int j = 0; j < jobs.size(); j++ )
+    {
+    if ( jobOffsets[ j + 1 ] == jobOffsets[ j ] )
+      {
+      continue;
+      }
+    unsigned int best = order[ jobOffsets[ j ] ] - jobOffsets[ j ];
+    bestOptimized[ j ] = jobs[ j ].m_MetricValues[ best ];
+    otherStarts.insert( otherStarts.end(), order.begin() + jobOffsets[ j ] + 1,
+      order.begin() + jobOffsets[ j + 1 ] );
+    }
+  search( true, otherStarts, true );
+}
+
+/** Keep the topK best scoring starts, in their original order. */
+template< class TStarts >
+void invariantSimilarityKeepBestStarts( TStarts & starts, unsigned int topK )
+{
+  const std::vector< double > & metricvalues = starts.m_MetricValues;
+  if ( topK == 0 || topK >= starts.m_Parameters.size() )
+    {
+    return;
+    }
+  std::vector< unsigned int > order( starts.m_Parameters.size() );
+  for ( unsigned int k = 0; k < order.size(); k++ )
+    {
+    order[ k ] = k;
+    }
+  std::partial_sort( order.begin(), order.begin() + topK, order.end(),
+    [&metricvalues]( unsigned int a, unsigned int b )
+      { return metricvalues[ a ] < metricvalues[ b ]; } );
+  order.resize( topK );
+  std::sort( order.begin(), order.end() );
+  std::vector< typename TStarts::ParametersType > keptParameters;
+  std::vector< double > keptValues;
+  std::vector< unsigned int > keptIndices;
+  std::vector< unsigned int > keptIterations;
+  for ( unsigned int k = 0; k < order.size(); k++ )
+    {
+    keptParameters.push_back( starts.m_Parameters[ order[ k ] ] );
+    keptValues.push_back( metricvalues[ order[ k ] ] );
+    keptIndices.push_back( starts.m_StartIndices[ order[ k ] ] );
+    keptIterations.push_back( starts.m_Iterations[ order[ k ] ] );
+    }
+  starts.m_Parameters.swap( keptParameters );
+  starts.m_MetricValues.swap( keptValues );
+  starts.m_StartIndices.swap( keptIndices );
+  starts.m_Iterations.swap( keptIterations );
+}
+
+/** A new image object that shares the pixel buffer of image.  Filters
+ * write the requested region of their inputs, so workers that run their
+ * own pipelines on a shared image each read it through a view of their
+ * own. */
+template< class TImage >
+typename TImage::Pointer invariantSimilarityImageView( const TImage * image )
+{
+  if ( image == nullptr )
+    {
+    return nullptr;
+    }
+  typename TImage::Pointer view = TImage::New();
+  view->CopyInformation( image );
+  view->SetRegions( image->GetLargestPossibleRegion() );
+  view->SetPixelContainer(
+    const_cast< TImage * >( image )->GetPixelContainer() );
+  return view;
+}
+
+/** Replace the translation of a start by the best one for its rotation.
+ * The moving image is resampled onto the fixed grid and one masked FFT
+ * normalized cross correlation against the fixed image scores every
+ * integer voxel shift at once.  The peak shift s means that fixed( x ) best
+ * matches moving( T( x - s ) ), so the translation of T is moved by -A s,
+ * A being the transform matrix.  Each worker of the search owns one of
+ * these and so its resampler, correlation filter and transform, which it
+ * reuses for every start it claims. */
+template< class TAffine, class TImage >
+class InvariantSimilarityFFTTranslationSearch
+{
+public:
+  typedef itk::ResampleImageFilter<TImage, TImage> ResamplerType;
+  typedef itk::MaskedFFTNormalizedCorrelationImageFilter
+    <TImage, TImage, TImage> CorrelationFilterType;
+  typedef itk::MinimumMaximumImageCalculator<TImage> MaximumCalculatorType;
+  enum { ImageDimension = TImage::ImageDimension };
+
+  InvariantSimilarityFFTTranslationSearch( const TImage * fixedImage,
+    const TImage * fixedMask )
+  {
+    m_FixedImage = invariantSimilarityImageView( fixedImage );
+    m_FixedMask = invariantSimilarityImageView( fixedMask );
+    m_Transform = TAffine::New();
+    m_Resampler = ResamplerType::New();
+    m_Resampler->SetTransform( m_Transform );
+    m_Resampler->SetReferenceImage( m_FixedImage );
+    m_Resampler->UseReferenceImageOn();
+    m_Resampler->SetDefaultPixelValue( 0 );
+    // the starts are the unit of parallelism so keep each filter serial
+    m_Resampler->SetNumberOfWorkUnits( 1 );
+    m_Correlation = CorrelationFilterType::New();
+    m_Correlation->SetFixedImage( m_FixedImage );
+    m_Correlation->SetMovingImage( m_Resampler->GetOutput() );
+    if ( m_FixedMask.IsNotNull() )
+      {
+      m_Correlation->SetFixedImageMask( m_FixedMask );
+      }
+    // ignore shifts where the images barely overlap
+    m_Correlation->SetRequiredFractionOfOverlappingPixels( 0.5 );
+    m_Correlation->SetNumberOfWorkUnits( 1 );
+  }
+
+  void Search( const TImage * movingImage,
+    const typename TAffine::InputPointType & center,
+    typename TAffine::ParametersType & parameters )
+  {
+    m_Transform->SetCenter( center );
+    m_Transform->SetParameters( parameters );
+    m_Resampler->SetInput( invariantSimilarityImageView( movingImage ) );
+    m_Correlation->Update();
+    typename MaximumCalculatorType::Pointer maximumCalculator =
+      MaximumCalculatorType::New();
+    maximumCalculator->SetImage( m_Correlation->GetOutput() );
+    maximumCalculator->ComputeMaximum();
+    typename TImage::IndexType peak =
+      maximumCalculator->GetIndexOfMaximum();
+    typename TImage::IndexType outputStart =
+      m_Correlation->GetOutput()->GetLargestPossibleRegion().GetIndex();
+    typename TImage::SizeType fixedSize =
+      m_FixedImage->GetLargestPossibleRegion().GetSize();
+    // zero shift sits at index movingSize - 1 of the correlation image
+    itk::Vector< double, ImageDimension > shift;
+    for ( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      shift[ d ] = m_FixedImage->GetSpacing()[ d ] * static_cast< double >(
+        peak[ d ] - outputStart[ d ] -
+          ( static_cast< long >( fixedSize[ d ] ) - 1 ) );
+      }
+    shift = m_FixedImage->GetDirection() * shift;
+    typename TAffine::OutputVectorType translation =
+      m_Transform->GetTranslation();
+    translation -= m_Transform->GetMatrix() * shift;
+    m_Transform->SetTranslation( translation );
+    parameters = m_Transform->GetParameters();
+  }
+
+private:
+  typename TImage::Pointer                  m_FixedImage;
+  typename TImage::Pointer                  m_FixedMask;
+  typename TAffine::Pointer                 m_Transform;
+  typename ResamplerType::Pointer           m_Resampler;
+  typename CorrelationFilterType::Pointer   m_Correlation;
+};
+
+/** Build the fixed point set shared by the metrics.  "FullImage" takes every
+ * N-th voxel of the whole image, N = 1 / samplingPercentage, and ignores the
+ * mask.  The other strategies only visit voxels inside the mask (when one is
+ * given): "Regular" takes every N-th of them, "Random" keeps each with
+ * probability samplingPercentage and "Gradient" keeps each with probability
+ * proportional to its gradient magnitude, at the same expected count. */
+template< class TPointSet, class TImage >
+typename TPointSet::Pointer invariantSimilaritySampledPointSet(
+  TImage * image, TImage * mask, const std::string & strategy,
+  double samplingPercentage )
+{
+  typedef typename TPointSet::PointType PointType;
+  typedef typename TImage::IndexType    IndexType;
+  samplingPercentage = std::min( 1.0, std::max( 1.e-6, samplingPercentage ) );
+  bool useMask = ( mask != nullptr ) && ( strategy.compare("FullImage") != 0 );
+  std::vector< IndexType > candidates;
+  itk::ImageRegionIteratorWithIndex<TImage> It( image,
+    image->GetLargestPossibleRegion() );
+  for( It.GoToBegin(); !It.IsAtEnd(); ++It )
+    {
+    if ( !useMask || mask->GetPixel( It.GetIndex() ) >= 0.5 )
+      {
+      candidates.push_back( It.GetIndex() );
+      }
+    }
+  std::vector< double > keepProbability;
+  if ( strategy.compare("Gradient") == 0 )
+    {
+    typedef itk::GradientMagnitudeRecursiveGaussianImageFilter<TImage, TImage>
+      GradientFilterType;
+    typename GradientFilterType::Pointer gradientFilter =
+      GradientFilterType::New();
+    gradientFilter->SetInput( image );
+    gradientFilter->SetSigma( image->GetSpacing()[0] );
+    gradientFilter->Update();
+    double totalGradient = 0;
+    keepProbability.resize( candidates.size() );
+    for ( unsigned long k = 0; k < candidates.size(); k++ )
+      {
+      keepProbability[ k ] =
+        gradientFilter->GetOutput()->GetPixel( candidates[ k ] );
+      totalGradient += keepProbability[ k ];
+      }
+    double expected = samplingPercentage * candidates.size();
+    for ( unsigned long k = 0; k < candidates.size(); k++ )
+      {
+      if ( totalGradient > 0 )
+        keepProbability[ k ] = std::min( 1.0,
+          expected * keepProbability[ k ] / totalGradient );
+      else keepProbability[ k ] = samplingPercentage;
+      }
+    }
+  else if ( strategy.compare("Random") == 0 )
+    {
+    keepProbability.assign( candidates.size(), samplingPercentage );
+    }
+  typename TPointSet::Pointer pset = TPointSet::New();
+  unsigned long stride = std::max< unsigned long >( 1,
+    static_cast< unsigned long >( 1.0 / samplingPercentage + 0.5 ) );
+  // fixed seed so that repeated calls see the same samples
+  std::mt19937 generator( 1234 );
+  std::uniform_real_distribution< double > uniform( 0.0, 1.0 );
+  unsigned int ind = 0;
+  for ( unsigned long k = 0; k < candidates.size(); k++ )
+    {
+    bool keep = keepProbability.empty() ? ( k % stride == 0 ) :
+      ( uniform( generator ) < keepProbability[ k ] );
+    if ( keep )
+      {
+      PointType pt;
+      image->TransformIndexToPhysicalPoint( candidates[ k ], pt );
+      pset->SetPoint( ind, pt );
+      ind++;
+      }
+    }
+  if ( ind == 0 && useMask )
+    {
+    return invariantSimilaritySampledPointSet<TPointSet>( image,
+      static_cast< TImage * >( nullptr ), "FullImage", samplingPercentage );
+    }
+  return pset;
+}
+
+template< class TImage >
+typename TImage::Pointer invariantSimilarityShrinkImage(
+  typename TImage::Pointer image, unsigned int shrinkFactor,
+  bool smooth = true, unsigned int numberOfWorkUnits = 0 )
+{
+  if ( image.IsNull() || shrinkFactor <= 1 )
+    {
+    return image;
+    }
+  typedef itk::ShrinkImageFilter<TImage, TImage> ShrinkerType;
+  typename ShrinkerType::Pointer shrinker = ShrinkerType::New();
+  shrinker->SetInput( image );
+  if ( numberOfWorkUnits > 0 )
+    {
+    shrinker->SetNumberOfWorkUnits( numberOfWorkUnits );
+    }
+  if ( smooth )
+    {
+    typedef itk::DiscreteGaussianImageFilter<TImage, TImage> SmootherType;
+    typename SmootherType::Pointer smoother = SmootherType::New();
+    smoother->SetInput( image );
+    smoother->SetUseImageSpacing( false );
+    smoother->SetVariance( 0.25 * shrinkFactor * shrinkFactor );
+    smoother->SetMaximumKernelWidth( 64 );
+    if ( numberOfWorkUnits > 0 )
+      {
+      smoother->SetNumberOfWorkUnits( numberOfWorkUnits );
+      }
+    shrinker->SetInput( smoother->GetOutput() );
+    }
+  shrinker->SetShrinkFactors( shrinkFactor );
+  shrinker->Update();
+  return shrinker->GetOutput();
+}
+
+/** The part of an invariantImageSimilarity call that depends on the fixed
+ * image alone: its moments, the mask spatial object and, for every pyramid
+ * level, the shrunk fixed image, its sampled point set and the flattened
+ * samples of the correlation evaluator.  The ITK metrics
+ * themselves are not cached because Initialize() binds the moving image. */
+template< unsigned int ImageDimension >
+class InvariantSimilarityFixedContext
+{
+public:
+  typedef itk::Image< float, ImageDimension >                ImageType;
+  typedef itk::ImageMomentsCalculator< ImageType >           CalculatorType;
+  typedef itk::ImageMaskSpatialObject< ImageDimension >      MaskSpatialObjectType;
+  typedef typename MaskSpatialObjectType::ImageType          MaskImageType;
+  typedef itk::MattesMutualInformationImageToImageMetricv4
+    < ImageType, ImageType, ImageType >                      MetricType;
+  typedef typename MetricType::FixedSampledPointSetType      PointSetType;
+
+  typename ImageType::Pointer                    m_Image;
+  typename ImageType::Pointer                    m_Mask;
+  typename MaskImageType::Pointer                m_MaskImage;
+  typename MaskSpatialObjectType::Pointer        m_MaskSpatialObject;
+  bool                                           m_MomentsValid;
+  typename CalculatorType::VectorType            m_CenterOfGravity;
+  typename CalculatorType::MatrixType            m_PrincipalAxes;
+  double                                         m_TotalMass;
+  double                                         m_VoxelVolume;
+  std::vector< unsigned int >                    m_ShrinkFactors;
+  std::vector< typename ImageType::Pointer >     m_LevelImages;
+  std::vector< typename ImageType::Pointer >     m_LevelMasks;
+  std::vector< typename PointSetType::Pointer >  m_LevelPointSets;
+  std::vector< InvariantSimilarityCorrelationEvaluator< ImageType > >
+                                                 m_LevelEvaluators;
+};
+
+template< unsigned int ImageDimension >
+void invariantSimilarityBuildFixedContext(
+  InvariantSimilarityFixedContext< ImageDimension > & context,
   typename itk::Image< float , ImageDimension >::Pointer image1,
-  typename itk::Image< float , ImageDimension >::Pointer image2,
-  SEXP r_thetas, SEXP r_thetas2, SEXP r_thetas3,
-  SEXP r_lsits, SEXP r_WM, SEXP r_scale,
-  SEXP r_doreflection, SEXP r_txfn,
-  typename itk::Image< float , ImageDimension >::Pointer imageMask = nullptr  )
+  typename itk::Image< float , ImageDimension >::Pointer imageMask,
+  SEXP r_shrinkFactors, SEXP r_samplingStrategy, SEXP r_samplingPercentage )
+{
+  typedef InvariantSimilarityFixedContext< ImageDimension > ContextType;
+  typedef typename ContextType::ImageType     ImageType;
+  typedef typename ContextType::PointSetType  PointSetType;
+  Rcpp::NumericVector shrinkFactors( r_shrinkFactors );
+  std::string samplingStrategy = Rcpp::as< std::string >( r_samplingStrategy );
+  double samplingPercentage = Rcpp::as< double >( r_samplingPercentage );
+
+  context.m_Image = image1;
+  context.m_Mask = imageMask;
+  context.m_MomentsValid = false;
+  context.m_CenterOfGravity.Fill( 0 );
+  context.m_TotalMass = 0;
+  typename ContextType::CalculatorType::Pointer calculator =
+    ContextType::CalculatorType::New();
+  calculator->SetImage( image1 );
+  try
+    {
+    calculator->Compute();
+    context.m_CenterOfGravity = calculator->GetCenterOfGravity();
+    context.m_PrincipalAxes = calculator->GetPrincipalAxes();
+    context.m_TotalMass = calculator->GetTotalMass();
+    context.m_MomentsValid = true;
+    }
+  catch( ... )
+    {
+    // Rcpp::Rcerr << " zero image1 error ";
+    }
+  context.m_VoxelVolume = 1;
+  for ( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    context.m_VoxelVolume *= image1->GetSpacing()[d];
+    }
+
+  context.m_MaskImage = nullptr;
+  context.m_MaskSpatialObject = nullptr;
+  if( imageMask.IsNotNull() )
+    {
+    typedef itk::CastImageFilter<ImageType,
+      typename ContextType::MaskImageType> CasterType;
+    typename CasterType::Pointer caster = CasterType::New();
+    caster->SetInput( imageMask );
+    caster->Update();
+    context.m_MaskImage = caster->GetOutput();
+    context.m_MaskSpatialObject = ContextType::MaskSpatialObjectType::New();
+    context.m_MaskSpatialObject->SetImage( context.m_MaskImage );
+    }
+
+  // with more than one level the coarsest only ranks the starts, the
+  // topK best of which are then refined at each finer level
+  unsigned int numberOfLevels = std::max< unsigned int >( 1,
+    shrinkFactors.size() );
+  context.m_ShrinkFactors.clear();
+  context.m_LevelImages.clear();
+  context.m_LevelMasks.clear();
+  context.m_LevelPointSets.clear();
+  context.m_LevelEvaluators.clear();
+  for ( unsigned int level = 0; level < numberOfLevels; level++ )
+    {
+    unsigned int shrinkFactor = 1;
+    if ( level < static_cast< unsigned int >( shrinkFactors.size() ) &&
+         shrinkFactors[ level ] > 1 )
+      {
+      shrinkFactor = static_cast< unsigned int >( shrinkFactors[ level ] );
+      }
+    typename ImageType::Pointer fixedLevel =
+      invariantSimilarityShrinkImage<ImageType>( image1, shrinkFactor );
+    typename ImageType::Pointer maskLevel =
+      invariantSimilarityShrinkImage<ImageType>( imageMask, shrinkFactor,
+        false );
+    // keep roughly the same number of samples at every level
+    double levelPercentage = samplingPercentage;
+    for ( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      levelPercentage *= shrinkFactor;
+      }
+    context.m_ShrinkFactors.push_back( shrinkFactor );
+    context.m_LevelImages.push_back( fixedLevel );
+    context.m_LevelMasks.push_back( maskLevel );
+    context.m_LevelPointSets.push_back(
+      invariantSimilaritySampledPointSet<PointSetType>(
+        fixedLevel.GetPointer(), maskLevel.GetPointer(), samplingStrategy,
+        levelPercentage ) );
+    context.m_LevelEvaluators.push_back(
+      InvariantSimilarityCorrelationEvaluator< ImageType >() );
+    context.m_LevelEvaluators.back().Initialize( fixedLevel.GetPointer(),
+      context.m_MaskImage.GetPointer(),
+      context.m_LevelPointSets.back().GetPointer() );
+    }
+}
+
+/** Use the context handed in from R when there is one, otherwise build a
+ * throwaway one from image1 and the mask. */
+template< unsigned int ImageDimension >
+const InvariantSimilarityFixedContext< ImageDimension > *
+invariantSimilarityGetFixedContext(
+  SEXP r_context,
+  InvariantSimilarityFixedContext< ImageDimension > & localContext,
+  typename itk::Image< float , ImageDimension >::Pointer image1,
+  typename itk::Image< float , ImageDimension >::Pointer imageMask,
+  SEXP r_shrinkFactors, SEXP r_samplingStrategy, SEXP r_samplingPercentage )
+{
+  if ( !Rf_isNull( r_context ) )
+    {
+    Rcpp::XPtr< InvariantSimilarityFixedContext< ImageDimension > >
+      context_xptr( r_context );
+    // an external pointer does not survive saveRDS or a new session
+    if ( context_xptr.get() == nullptr )
+      {
+      Rcpp::stop( "The fixed image context is no longer valid; "
+        "rebuild it with invariantImageSimilarityContext." );
+      }
+    return context_xptr.get();
+    }
+  invariantSimilarityBuildFixedContext<ImageDimension>( localContext, image1,
+    imageMask, r_shrinkFactors, r_samplingStrategy, r_samplingPercentage );
+  return &localContext;
+}
+
+/** Align the moving image's principal axes with the fixed image's and lay
+ * out one start per rotation.  Only touches ITK so that batches can set
+ * their images up concurrently.  Returns false when there is nothing to
+ * search. */
+template< unsigned int ImageDimension, class AffineType >
+bool invariantSimilarityInitializeStarts(
+  const InvariantSimilarityFixedContext< ImageDimension > & context,
+  const std::vector< double > & thetas,
+  const std::vector< double > & thetas2,
+  const std::vector< double > & thetas3,
+  int doReflection, double bestscale,
+  InvariantSimilarityStarts< itk::Image< float, ImageDimension >, AffineType >
+    & starts )
 {
-  unsigned int mibins = 20;
-  unsigned int localSearchIterations =
-    Rcpp::as< unsigned int >( r_lsits ) ;
-  std::string whichMetric = Rcpp::as< std::string >( r_WM );
-  std::string txfn = Rcpp::as< std::string >( r_txfn );
   bool useprincaxis = true;
-  typedef typename itk::ImageMaskSpatialObject<ImageDimension>::ImageType
-    maskimagetype;
-  typename maskimagetype::Pointer mask = nullptr;
-  Rcpp::NumericVector thetas( r_thetas );
-  Rcpp::NumericVector thetas2( r_thetas2 );
-  Rcpp::NumericVector thetas3( r_thetas3 );
-  Rcpp::IntegerVector doReflection( r_doreflection );
   typedef float  PixelType;
   typedef double RealType;
-  RealType bestscale = Rcpp::as< RealType >( r_scale ) ;
   typedef itk::Image< PixelType , ImageDimension > ImageType;
-  if( image1.IsNotNull() & image2.IsNotNull() )
-    {
-    typedef typename itk::ImageMomentsCalculator<ImageType> ImageCalculatorType;
-    typedef itk::AffineTransform<RealType, ImageDimension> AffineType0;
-    typedef typename ImageCalculatorType::MatrixType       MatrixType;
-    typedef itk::Vector<float, ImageDimension>  VectorType;
-    VectorType ccg1;
-    VectorType cpm1;
-    MatrixType cpa1;
-    VectorType ccg2;
-    VectorType cpm2;
-    MatrixType cpa2;
-    typename ImageCalculatorType::Pointer calculator1 =
-      ImageCalculatorType::New();
-    typename ImageCalculatorType::Pointer calculator2 =
-      ImageCalculatorType::New();
-    calculator1->SetImage(  image1 );
-    calculator2->SetImage(  image2 );
-    typename ImageCalculatorType::VectorType fixed_center;
-    fixed_center.Fill(0);
-    typename ImageCalculatorType::VectorType moving_center;
-    moving_center.Fill(0);
+  typename ImageType::Pointer image2 = starts.m_MovingImage;
+  typedef typename itk::ImageMomentsCalculator<ImageType> ImageCalculatorType;
+  typedef itk::AffineTransform<RealType, ImageDimension> AffineType0;
+  typedef typename ImageCalculatorType::MatrixType       MatrixType;
+  typedef itk::Vector<float, ImageDimension>  VectorType;
+  MatrixType cpa1 = context.m_PrincipalAxes;
+  VectorType ccg2;
+  VectorType cpm2;
+  MatrixType cpa2;
+  typename ImageCalculatorType::Pointer calculator2 =
+    ImageCalculatorType::New();
+  calculator2->SetImage(  image2 );
+  typename ImageCalculatorType::VectorType fixed_center;
+  fixed_center.Fill(0);
+  typename ImageCalculatorType::VectorType moving_center;
+  moving_center.Fill(0);
+  if ( context.m_MomentsValid )
+    {
+    fixed_center = context.m_CenterOfGravity;
     try
       {
-      calculator1->Compute();
-      fixed_center = calculator1->GetCenterOfGravity();
-      ccg1 = calculator1->GetCenterOfGravity();
-      cpm1 = calculator1->GetPrincipalMoments();
-      cpa1 = calculator1->GetPrincipalAxes();
-      try
+      calculator2->Compute();
+      moving_center = calculator2->GetCenterOfGravity();
+      ccg2 = calculator2->GetCenterOfGravity();
+      cpm2 = calculator2->GetPrincipalMoments();
+      cpa2 = calculator2->GetPrincipalAxes();
+      }
+    catch( ... )
+      {
+      fixed_center.Fill(0);
+      }
+    }
+  if ( std::abs( bestscale - 1.0 ) < 1.e-6 )
+    {
+    RealType volelt2 = 1;
+    for ( unsigned int d=0; d<ImageDimension; d++)
+      {
+      volelt2 *= image2->GetSpacing()[d];
+      }
+    bestscale =
+      ( calculator2->GetTotalMass() * volelt2 )/
+      ( context.m_TotalMass * context.m_VoxelVolume );
+    RealType powlev = 1.0 / static_cast<RealType>(ImageDimension);
+    bestscale = std::pow( bestscale , powlev );
+  }
+  unsigned int eigind1 = 1;
+  unsigned int eigind2 = 1;
+  if( ImageDimension == 3 )
+    {
+    eigind1 = 2;
+    }
+  typedef vnl_vector<RealType> EVectorType;
+  typedef vnl_matrix<RealType> EMatrixType;
+  EVectorType evec1_2ndary = cpa1.GetVnlMatrix().get_row( eigind2 );
+  EVectorType evec1_primary = cpa1.GetVnlMatrix().get_row( eigind1 );
+  EVectorType evec2_2ndary  = cpa2.GetVnlMatrix().get_row( eigind2 );
+  EVectorType evec2_primary = cpa2.GetVnlMatrix().get_row( eigind1 );
+  /** Solve Wahba's problem http://en.wikipedia.org/wiki/Wahba%27s_problem */
+  EMatrixType B = outer_product( evec2_primary, evec1_primary );
+  if( ImageDimension == 3 )
+    {
+    B = outer_product( evec2_2ndary, evec1_2ndary )
+      + outer_product( evec2_primary, evec1_primary );
+    }
+  vnl_svd<RealType>    wahba( B );
+  vnl_matrix<RealType> A_solution = wahba.V() * wahba.U().transpose();
+  A_solution = vnl_inverse( A_solution );
+  RealType det = vnl_determinant( A_solution  );
+  if( ( det < 0 ) )
+    {
+    vnl_matrix<RealType> id( A_solution );
+    id.set_identity();
+    for( unsigned int i = 0; i < ImageDimension; i++ )
+      {
+      if( A_solution( i, i ) < 0 )
+        {
+        id( i, i ) = -1.0;
+        }
+      }
+    A_solution =  A_solution * id.transpose();
+    }
+  if ( doReflection == 1 ||  doReflection == 3 )
+    {
+      vnl_matrix<RealType> id( A_solution );
+      id.set_identity();
+      id = id - 2.0 * outer_product( evec2_primary , evec2_primary  );
+      A_solution = A_solution * id;
+    }
+  if ( doReflection > 1 )
+    {
+      vnl_matrix<RealType> id( A_solution );
+      id.set_identity();
+      id = id - 2.0 * outer_product( evec1_primary , evec1_primary  );
+      A_solution = A_solution * id;
+    }
+  typename AffineType::Pointer affine1 = AffineType::New();
+  typename AffineType::OffsetType trans = affine1->GetOffset();
+  itk::Point<RealType, ImageDimension> trans2;
+  for( unsigned int i = 0; i < ImageDimension; i++ )
+    {
+    trans[i] = moving_center[i] - fixed_center[i];
+    trans2[i] =  fixed_center[i] * ( 1 );
+    }
+  affine1->SetIdentity();
+  affine1->SetOffset( trans );
+  if( useprincaxis )
+    {
+    affine1->SetMatrix( A_solution );
+    }
+  affine1->SetCenter( trans2 );
+  if( ImageDimension > 3  )
+    {
+    return false;
+    }
+  vnl_vector<RealType> evec_tert;
+  if( ImageDimension == 3 )
+    { // try to rotate around tertiary and secondary axis
+    evec_tert = vnl_cross_3d( evec1_primary, evec1_2ndary );
+    }
+  if( ImageDimension == 2 )
+    { // try to rotate around tertiary and secondary axis
+    evec_tert = evec1_2ndary;
+    evec1_2ndary = evec1_primary;
+    }
+  itk::Vector<RealType, ImageDimension> axis1;
+  itk::Vector<RealType, ImageDimension> axis2;
+  itk::Vector<RealType, ImageDimension> axis3;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    axis1[d] = evec_tert[d];
+    axis2[d] = evec1_2ndary[d];
+    axis3[d] = evec1_primary[d];
+    }
+  typename AffineType::Pointer simmer = AffineType::New();
+  simmer->SetIdentity();
+  simmer->SetCenter( trans2 );
+  simmer->SetOffset( trans );
+  typename AffineType0::Pointer affinesearch = AffineType0::New();
+  affinesearch->SetIdentity();
+  affinesearch->SetCenter( trans2 );
+  starts.m_Center = trans2;
+  starts.m_InitialParameters = affine1->GetParameters();
+  starts.m_Parameters.clear();
+  affinesearch->SetIdentity();
+  affinesearch->SetCenter( trans2 );
+  affinesearch->SetOffset( trans );
+  for ( unsigned int i = 0; i < thetas.size(); i++ )
+    {
+    RealType ang1 = thetas[i];
+    RealType ang2 = 0; // FIXME should be psi
+    RealType ang3 = 0; // FIXME should be psi
+    if( ImageDimension == 3 )
+      {
+      for ( unsigned int jj = 0; jj < thetas2.size(); jj++ )
+      {
+      ang2=thetas2[jj];
+      for ( unsigned int kk = 0; kk < thetas3.size(); kk++ )
+      {
+      ang3=thetas3[kk];
+      affinesearch->SetIdentity();
+      affinesearch->SetCenter( trans2 );
+      affinesearch->SetOffset( trans );
+      if( useprincaxis )
         {
-        calculator2->Compute();
-        moving_center = calculator2->GetCenterOfGravity();
-        ccg2 = calculator2->GetCenterOfGravity();
-        cpm2 = calculator2->GetPrincipalMoments();
-        cpa2 = calculator2->GetPrincipalAxes();
+        affinesearch->SetMatrix( A_solution );
         }
-      catch( ... )
+      affinesearch->Rotate3D(axis1, ang1, 1);
+      affinesearch->Rotate3D(axis2, ang2, 1);
+      affinesearch->Rotate3D(axis3, ang3, 1);
+//      affinesearch->Scale( bestscale ); // BUG: annoying, cant do for rigid
+      simmer->SetMatrix(  affinesearch->GetMatrix() );
+      starts.m_Parameters.push_back( simmer->GetParameters() );
+      } // kk
+      }
+      }
+    if( ImageDimension == 2 )
+      {
+      affinesearch->SetIdentity();
+      affinesearch->SetCenter( trans2 );
+      affinesearch->SetOffset( trans );
+      if( useprincaxis )
         {
-        fixed_center.Fill(0);
+        affinesearch->SetMatrix( A_solution );
         }
+      affinesearch->Rotate2D( ang1, 1);
+//      affinesearch->Scale( bestscale );
+      simmer->SetMatrix(  affinesearch->GetMatrix() );
+      starts.m_Parameters.push_back( simmer->GetParameters() );
       }
-    catch( ... )
+    }
+  starts.m_StartIndices.resize( starts.m_Parameters.size() );
+  for ( unsigned int k = 0; k < starts.m_StartIndices.size(); k++ )
+    {
+    starts.m_StartIndices[ k ] = k;
+    }
+  starts.m_Iterations.assign( starts.m_Parameters.size(), 0 );
+  starts.m_NumberOfPrunedStarts = 0;
+  return true;
+}
+
+/** Search the starts of all images level by level; every (image, start)
+ * pair of a level goes to the same pool of workers.  With more than one
+ * level the coarsest only ranks the starts, the topK best of which are
+ * then refined at each finer level. */
+template< unsigned int ImageDimension, class AffineType >
+void invariantSimilaritySearchLevels(
+  const InvariantSimilarityFixedContext< ImageDimension > & context,
+  std::vector< InvariantSimilarityStarts<
+    itk::Image< float, ImageDimension >, AffineType > > & jobs,
+  const InvariantSimilaritySearchOptions & options )
+{
+  typedef InvariantSimilarityFixedContext< ImageDimension > ContextType;
+  typedef typename ContextType::ImageType     ImageType;
+  typedef typename ContextType::MetricType    MetricType;
+  typedef typename ContextType::PointSetType  PointSetType;
+  typedef itk::CorrelationImageToImageMetricv4
+    <ImageType, ImageType, ImageType> GCMetricType;
+  const unsigned int mibins = 20;
+  const typename ContextType::MaskSpatialObjectType * so =
+    context.m_MaskSpatialObject.GetPointer();
+  const unsigned int numberOfLevels = context.m_LevelImages.size();
+  for ( unsigned int level = 0; level < numberOfLevels; level++ )
+    {
+    const ImageType * fixedLevel = context.m_LevelImages[ level ];
+    PointSetType * pset = context.m_LevelPointSets[ level ].GetPointer();
+    const unsigned int shrinkFactor = context.m_ShrinkFactors[ level ];
+    invariantSimilarityRunWorkers( jobs.size(),
+      [&]( std::atomic< unsigned int > & nextJob )
+      {
+      for ( unsigned int j = nextJob++; j < jobs.size(); j = nextJob++ )
+        {
+        jobs[ j ].m_MovingLevel = invariantSimilarityShrinkImage<ImageType>(
+          jobs[ j ].m_MovingImage, shrinkFactor, true, 1 );
+        }
+      } );
+    // the coarsest level picks each start's translation, the finer ones
+    // only refine it
+    if ( options.m_FFTTranslation && level == 0 )
+      {
+      // start i is start i - startOffsets[ j ] of image j
+      std::vector< unsigned int > startOffsets( jobs.size() + 1, 0 );
+      for ( unsigned int j = 0; j < jobs.size(); j++ )
+        {
+        startOffsets[ j + 1 ] = startOffsets[ j ] +
+          jobs[ j ].m_Parameters.size();
+        }
+      const ImageType * levelMask = context.m_LevelMasks[ level ].GetPointer();
+      invariantSimilarityRunWorkers( startOffsets.back(),
+        [&]( std::atomic< unsigned int > & nextStart )
+        {
+        InvariantSimilarityFFTTranslationSearch< AffineType, ImageType >
+          translationSearch( fixedLevel, levelMask );
+        for ( unsigned int i = nextStart++; i < startOffsets.back();
+              i = nextStart++ )
+          {
+          unsigned int j = std::upper_bound( startOffsets.begin(),
+            startOffsets.end(), i ) - startOffsets.begin() - 1;
+          translationSearch.Search( jobs[ j ].m_MovingLevel.GetPointer(),
+            jobs[ j ].m_Center, jobs[ j ].m_Parameters[ i - startOffsets[ j ] ] );
+          }
+        } );
+      }
+    const InvariantSimilarityCorrelationEvaluator< ImageType > * evaluator =
+      nullptr;
+    unsigned int levelIterations = options.m_LocalSearchIterations;
+    if ( level == 0 && numberOfLevels > 1 )
       {
-      // Rcpp::Rcerr << " zero image1 error ";
+      levelIterations = 0;
       }
-    if ( std::abs( bestscale - 1.0 ) < 1.e-6 )
+    if ( options.m_Metric.compare("MI") == 0  )
       {
-      RealType volelt1 = 1;
-      RealType volelt2 = 1;
-      for ( unsigned int d=0; d<ImageDimension; d++)
+      invariantSimilarityMultiStartSearch<MetricType, AffineType>(
+        fixedLevel, so, pset, mibins, levelIterations,
+        options.m_PruneQuantile, options.m_PruneMargin, evaluator, jobs );
+      }
+    else
+      {
+      // without the lean evaluator every start is scored with the ITK
+      // metric, for testing and benchmarking the evaluator against it
+      if ( options.m_LeanEvaluator )
         {
-        volelt1 *= image1->GetSpacing()[d];
-        volelt2 *= image2->GetSpacing()[d];
+        evaluator = &context.m_LevelEvaluators[ level ];
         }
-      bestscale =
-        ( calculator2->GetTotalMass() * volelt2 )/
-        ( calculator1->GetTotalMass() * volelt1 );
-      RealType powlev = 1.0 / static_cast<RealType>(ImageDimension);
-      bestscale = std::pow( bestscale , powlev );
-    }
-    unsigned int eigind1 = 1;
-    unsigned int eigind2 = 1;
-    if( ImageDimension == 3 )
+      invariantSimilarityMultiStartSearch<GCMetricType, AffineType>(
+        fixedLevel, so, pset, mibins, levelIterations,
+        options.m_PruneQuantile, options.m_PruneMargin, evaluator, jobs );
+      }
+    if ( level == 0 && numberOfLevels > 1 )
       {
-      eigind1 = 2;
+      for ( unsigned int j = 0; j < jobs.size(); j++ )
+        {
+        invariantSimilarityKeepBestStarts( jobs[ j ], options.m_TopK );
+        }
       }
-    typedef vnl_vector<RealType> EVectorType;
-    typedef vnl_matrix<RealType> EMatrixType;
-    EVectorType evec1_2ndary = cpa1.GetVnlMatrix().get_row( eigind2 );
-    EVectorType evec1_primary = cpa1.GetVnlMatrix().get_row( eigind1 );
-    EVectorType evec2_2ndary  = cpa2.GetVnlMatrix().get_row( eigind2 );
-    EVectorType evec2_primary = cpa2.GetVnlMatrix().get_row( eigind1 );
-    /** Solve Wahba's problem http://en.wikipedia.org/wiki/Wahba%27s_problem */
-    EMatrixType B = outer_product( evec2_primary, evec1_primary );
-    if( ImageDimension == 3 )
+    }
+  for ( unsigned int j = 0; j < jobs.size(); j++ )
+    {
+    jobs[ j ].m_MovingLevel = nullptr;
+    }
+}
+
+/** One row per start: the metric value, the transform parameters and the
+ * fixed parameters.  The best transform is written to txfn if one is
+ * named. */
+template< unsigned int ImageDimension, class AffineType >
+Rcpp::NumericMatrix invariantSimilarityResultMatrix(
+  const InvariantSimilarityStarts< itk::Image< float, ImageDimension >,
+    AffineType > & starts, const std::string & txfn )
+{
+  typedef typename AffineType::ParametersType ParametersType;
+  const std::vector< double > & metricvalues = starts.m_MetricValues;
+  unsigned int bestStart = 0;
+  for ( unsigned int k = 1; k < metricvalues.size(); k++ )
+    {
+    if ( metricvalues[ k ] < metricvalues[ bestStart ] ) bestStart = k;
+    }
+  typename AffineType::Pointer bestaffine = AffineType::New();
+  bestaffine->SetCenter( starts.m_Center );
+  bestaffine->SetParameters( starts.m_Parameters[ bestStart ] );
+  if ( txfn.length() > 3 )
+    {
+    typedef itk::TransformFileWriter TransformWriterType;
+    typename TransformWriterType::Pointer transformWriter =
+      TransformWriterType::New();
+    transformWriter->SetInput( bestaffine );
+    transformWriter->SetFileName( txfn.c_str() );
+    transformWriter->Update();
+    }
+  unsigned int ncols = bestaffine->GetParameters().Size() +
+    1 + ImageDimension;
+  Rcpp::NumericMatrix outMat( metricvalues.size(), ncols );
+  for ( unsigned int k = 0; k < metricvalues.size(); k++ )
+    {
+    outMat( k, 0 ) = metricvalues[ k ];
+    const ParametersType & resultParams = starts.m_Parameters[ k ];
+    for ( unsigned int kp = 0; kp < resultParams.Size(); kp++ )
       {
-      B = outer_product( evec2_2ndary, evec1_2ndary )
-        + outer_product( evec2_primary, evec1_primary );
+      outMat( k, kp + 1 ) = resultParams[ kp ];
       }
-    vnl_svd<RealType>    wahba( B );
-    vnl_matrix<RealType> A_solution = wahba.V() * wahba.U().transpose();
-    A_solution = vnl_inverse( A_solution );
-    RealType det = vnl_determinant( A_solution  );
-    if( ( det < 0 ) )
+    // set the fixed parameters
+    unsigned int baseind = resultParams.Size() + 1;
+    for ( unsigned int kp = 0; kp < ImageDimension; kp++ )
+      outMat( k, baseind + kp ) = bestaffine->GetFixedParameters()[ kp ];
+    }
+  Rcpp::IntegerVector startIndex( starts.m_StartIndices.size() );
+  for ( unsigned int k = 0; k < starts.m_StartIndices.size(); k++ )
+    {
+    startIndex[ k ] = starts.m_StartIndices[ k ] + 1;
+    }
+  outMat.attr( "startIndex" ) = startIndex;
+  outMat.attr( "iterations" ) = Rcpp::wrap( starts.m_Iterations );
+  outMat.attr( "numberOfPrunedStarts" ) = starts.m_NumberOfPrunedStarts;
+  return outMat;
+}
+
+template< unsigned int ImageDimension, class AffineType >
+SEXP invariantSimilarityHelper(
+  const InvariantSimilarityFixedContext< ImageDimension > & context,
+  typename itk::Image< float , ImageDimension >::Pointer image2,
+  SEXP r_thetas, SEXP r_thetas2, SEXP r_thetas3,
+  SEXP r_lsits, SEXP r_WM, SEXP r_scale,
+  SEXP r_doreflection, SEXP r_txfn, SEXP r_topK, SEXP r_fftTranslation,
+  SEXP r_pruning, SEXP r_leanEvaluator )
+{
+  typedef itk::Image< float , ImageDimension > ImageType;
+  typedef InvariantSimilarityStarts< ImageType, AffineType > StartsType;
+  InvariantSimilaritySearchOptions options = invariantSimilarityReadOptions(
+    r_WM, r_lsits, r_topK, r_fftTranslation, r_pruning, r_leanEvaluator );
+  std::string txfn = Rcpp::as< std::string >( r_txfn );
+  std::vector< double > thetas = Rcpp::as< std::vector< double > >( r_thetas );
+  std::vector< double > thetas2 =
+    Rcpp::as< std::vector< double > >( r_thetas2 );
+  std::vector< double > thetas3 =
+    Rcpp::as< std::vector< double > >( r_thetas3 );
+  Rcpp::IntegerVector doReflection( r_doreflection );
+  double bestscale = Rcpp::as< double >( r_scale ) ;
+  if( context.m_Image.IsNull() || image2.IsNull() )
+    {
+    Rcpp::NumericMatrix outMat( 1, 1 );
+    outMat( 0, 0 ) = 0;
+    return Rcpp::wrap( outMat );
+    }
+  std::vector< StartsType > jobs( 1 );
+  jobs[ 0 ].m_MovingImage = image2;
+  if ( !invariantSimilarityInitializeStarts<ImageDimension, AffineType>(
+         context, thetas, thetas2, thetas3, doReflection[0], bestscale,
+         jobs[ 0 ] ) )
+    {
+    return Rcpp::wrap( EXIT_SUCCESS );
+    }
+  invariantSimilaritySearchLevels<ImageDimension, AffineType>( context, jobs,
+    options );
+  return Rcpp::wrap( invariantSimilarityResultMatrix<ImageDimension,
+    AffineType>( jobs[ 0 ], txfn ) );
+}
+
+/** As invariantSimilarityHelper for a list of moving images that share one
+ * fixed image.  The per image set up and every level's (image, start)
+ * pairs each run on one pool of workers; returns one matrix per image. */
+template< unsigned int ImageDimension, class AffineType >
+SEXP invariantSimilarityBatchHelper(
+  const InvariantSimilarityFixedContext< ImageDimension > & context,
+  SEXP r_movingImages,
+  SEXP r_thetas, SEXP r_thetas2, SEXP r_thetas3,
+  SEXP r_lsits, SEXP r_WM, SEXP r_scale,
+  SEXP r_doreflection, SEXP r_txfns, SEXP r_topK, SEXP r_fftTranslation,
+  SEXP r_pruning, SEXP r_leanEvaluator )
+{
+  typedef itk::Image< float , ImageDimension > ImageType;
+  typedef typename ImageType::Pointer ImagePointerType;
+  typedef InvariantSimilarityStarts< ImageType, AffineType > StartsType;
+  Rcpp::List movingImages( r_movingImages );
+  Rcpp::CharacterVector txfns( r_txfns );
+  InvariantSimilaritySearchOptions options = invariantSimilarityReadOptions(
+    r_WM, r_lsits, r_topK, r_fftTranslation, r_pruning, r_leanEvaluator );
+  std::vector< double > thetas = Rcpp::as< std::vector< double > >( r_thetas );
+  std::vector< double > thetas2 =
+    Rcpp::as< std::vector< double > >( r_thetas2 );
+  std::vector< double > thetas3 =
+    Rcpp::as< std::vector< double > >( r_thetas3 );
+  Rcpp::IntegerVector doReflection( r_doreflection );
+  double bestscale = Rcpp::as< double >( r_scale ) ;
+  const unsigned int numberOfImages = movingImages.size();
+
+  std::vector< StartsType > jobs( numberOfImages );
+  for ( unsigned int j = 0; j < numberOfImages; j++ )
+    {
+    Rcpp::S4 in_image2( movingImages[ j ] );
+    Rcpp::XPtr< ImagePointerType > antsimage_xptr2(
+      static_cast< SEXP >( in_image2.slot( "pointer" ) ) );
+    jobs[ j ].m_MovingImage = *antsimage_xptr2;
+    }
+  std::vector< char > searched( numberOfImages, 0 );
+  if ( context.m_Image.IsNotNull() )
+    {
+    invariantSimilarityRunWorkers( numberOfImages,
+      [&]( std::atomic< unsigned int > & nextJob )
       {
-      vnl_matrix<RealType> id( A_solution );
-      id.set_identity();
-      for( unsigned int i = 0; i < ImageDimension; i++ )
+      for ( unsigned int j = nextJob++; j < numberOfImages; j = nextJob++ )
         {
-        if( A_solution( i, i ) < 0 )
+        if ( jobs[ j ].m_MovingImage.IsNotNull() )
           {
-          id( i, i ) = -1.0;
+          searched[ j ] = invariantSimilarityInitializeStarts<ImageDimension,
+            AffineType>( context, thetas, thetas2, thetas3, doReflection[0],
+              bestscale, jobs[ j ] );
           }
         }
-      A_solution =  A_solution * id.transpose();
-      }
-    if ( doReflection[0] == 1 ||  doReflection[0] == 3 )
-      {
-        vnl_matrix<RealType> id( A_solution );
-        id.set_identity();
-        id = id - 2.0 * outer_product( evec2_primary , evec2_primary  );
-        A_solution = A_solution * id;
-      }
-    if ( doReflection[0] > 1 )
-      {
-        vnl_matrix<RealType> id( A_solution );
-        id.set_identity();
-        id = id - 2.0 * outer_product( evec1_primary , evec1_primary  );
-        A_solution = A_solution * id;
-      }
-    typename AffineType::Pointer affine1 = AffineType::New();
-    typename AffineType::OffsetType trans = affine1->GetOffset();
-    itk::Point<RealType, ImageDimension> trans2;
-    for( unsigned int i = 0; i < ImageDimension; i++ )
-      {
-      trans[i] = moving_center[i] - fixed_center[i];
-      trans2[i] =  fixed_center[i] * ( 1 );
-      }
-    affine1->SetIdentity();
-    affine1->SetOffset( trans );
-    if( useprincaxis )
-      {
-      affine1->SetMatrix( A_solution );
-      }
-    affine1->SetCenter( trans2 );
-    if( ImageDimension > 3  )
+      } );
+    }
+  invariantSimilaritySearchLevels<ImageDimension, AffineType>( context, jobs,
+    options );
+  Rcpp::List outList( numberOfImages );
+  for ( unsigned int j = 0; j < numberOfImages; j++ )
+    {
+    if ( searched[ j ] )
       {
-      return EXIT_SUCCESS;
-      }
-    vnl_vector<RealType> evec_tert;
-    if( ImageDimension == 3 )
-      { // try to rotate around tertiary and secondary axis
-      evec_tert = vnl_cross_3d( evec1_primary, evec1_2ndary );
-      }
-    if( ImageDimension == 2 )
-      { // try to rotate around tertiary and secondary axis
-      evec_tert = evec1_2ndary;
-      evec1_2ndary = evec1_primary;
-      }
-    itk::Vector<RealType, ImageDimension> axis1;
-    itk::Vector<RealType, ImageDimension> axis2;
-    itk::Vector<RealType, ImageDimension> axis3;
-    for( unsigned int d = 0; d < ImageDimension; d++ )
-      {
-      axis1[d] = evec_tert[d];
-      axis2[d] = evec1_2ndary[d];
-      axis3[d] = evec1_primary[d];
-      }
-    typename AffineType::Pointer simmer = AffineType::New();
-    simmer->SetIdentity();
-    simmer->SetCenter( trans2 );
-    simmer->SetOffset( trans );
-    typename AffineType0::Pointer affinesearch = AffineType0::New();
-    affinesearch->SetIdentity();
-    affinesearch->SetCenter( trans2 );
-    typedef  itk::MultiStartOptimizerv4         OptimizerType;
-    typename OptimizerType::MetricValuesListType metricvalues;
-    typename OptimizerType::Pointer  mstartOptimizer = OptimizerType::New();
-    typedef itk::CorrelationImageToImageMetricv4
-      <ImageType, ImageType, ImageType> GCMetricType;
-    typedef itk::MattesMutualInformationImageToImageMetricv4
-      <ImageType, ImageType, ImageType> MetricType;
-    typename MetricType::ParametersType newparams(  affine1->GetParameters() );
-    typename GCMetricType::Pointer gcmetric = GCMetricType::New();
-    gcmetric->SetFixedImage( image1 );
-    gcmetric->SetVirtualDomainFromImage( image1 );
-    gcmetric->SetMovingImage( image2 );
-    gcmetric->SetMovingTransform( simmer );
-    gcmetric->SetParameters( newparams );
-    typename MetricType::Pointer mimetric = MetricType::New();
-    mimetric->SetNumberOfHistogramBins( mibins );
-    mimetric->SetFixedImage( image1 );
-    mimetric->SetMovingImage( image2 );
-    mimetric->SetMovingTransform( simmer );
-    mimetric->SetParameters( newparams );
-    if( imageMask.IsNotNull() )
-      {
-      typedef itk::CastImageFilter<ImageType, maskimagetype> CasterType;
-      typename CasterType::Pointer caster = CasterType::New();
-      caster->SetInput( imageMask );
-      caster->Update();
-      mask = caster->GetOutput();
-      typename itk::ImageMaskSpatialObject<ImageDimension>::Pointer so =
-        itk::ImageMaskSpatialObject<ImageDimension>::New();
-      so->SetImage( const_cast<maskimagetype *>( mask.GetPointer() ) );
-      mimetric->SetFixedImageMask( so );
-      gcmetric->SetFixedImageMask( so );
-      }
-    typedef  itk::ConjugateGradientLineSearchOptimizerv4 LocalOptimizerType;
-    typename LocalOptimizerType::Pointer  localoptimizer =
-      LocalOptimizerType::New();
-    RealType     localoptimizerlearningrate = 0.1;
-    localoptimizer->SetLearningRate( localoptimizerlearningrate );
-    localoptimizer->SetMaximumStepSizeInPhysicalUnits(
-      localoptimizerlearningrate );
-    localoptimizer->SetNumberOfIterations( localSearchIterations );
-    localoptimizer->SetLowerLimit( 0 );
-    localoptimizer->SetUpperLimit( 2 );
-    localoptimizer->SetEpsilon( 0.1 );
-    localoptimizer->SetMaximumLineSearchIterations( 50 );
-    localoptimizer->SetDoEstimateLearningRateOnce( true );
-    localoptimizer->SetMinimumConvergenceValue( 1.e-6 );
-    localoptimizer->SetConvergenceWindowSize( 5 );
-    if( true )
-      {
-      typedef typename MetricType::FixedSampledPointSetType PointSetType;
-      typedef typename PointSetType::PointType              PointType;
-      typename PointSetType::Pointer      pset(PointSetType::New());
-      unsigned int ind=0;
-      unsigned int ct=0;
-      itk::ImageRegionIteratorWithIndex<ImageType> It(image1,
-        image1->GetLargestPossibleRegion() );
-      for( It.GoToBegin(); !It.IsAtEnd(); ++It )
-        {
-        // take every N^th point
-        if ( ct % 10 == 0  )
-          {
-          PointType pt;
-          image1->TransformIndexToPhysicalPoint( It.GetIndex(), pt);
-          pset->SetPoint(ind, pt);
-          ind++;
-          }
-          ct++;
-        }
-      mimetric->SetFixedSampledPointSet( pset );
-      mimetric->SetUseSampledPointSet( true );
-      gcmetric->SetFixedSampledPointSet( pset );
-      gcmetric->SetUseSampledPointSet( true );
-    }
-    if ( whichMetric.compare("MI") == 0  ) {
-      mimetric->Initialize();
-      typedef itk::RegistrationParameterScalesFromPhysicalShift<MetricType>
-      RegistrationParameterScalesFromPhysicalShiftType;
-      typename RegistrationParameterScalesFromPhysicalShiftType::Pointer
-      shiftScaleEstimator =
-      RegistrationParameterScalesFromPhysicalShiftType::New();
-      shiftScaleEstimator->SetMetric( mimetric );
-      shiftScaleEstimator->SetTransformForward( true );
-      typename RegistrationParameterScalesFromPhysicalShiftType::ScalesType
-      movingScales( simmer->GetNumberOfParameters() );
-      shiftScaleEstimator->EstimateScales( movingScales );
-      mstartOptimizer->SetScales( movingScales );
-      mstartOptimizer->SetMetric( mimetric );
-      localoptimizer->SetMetric( mimetric );
-      localoptimizer->SetScales( movingScales );
-    }
-    if ( whichMetric.compare("MI") != 0  ) {
-      gcmetric->Initialize();
-      typedef itk::RegistrationParameterScalesFromPhysicalShift<GCMetricType>
-        RegistrationParameterScalesFromPhysicalShiftType;
-      typename RegistrationParameterScalesFromPhysicalShiftType::Pointer
-        shiftScaleEstimator =
-        RegistrationParameterScalesFromPhysicalShiftType::New();
-      shiftScaleEstimator->SetMetric( gcmetric );
-      shiftScaleEstimator->SetTransformForward( true );
-      typename RegistrationParameterScalesFromPhysicalShiftType::ScalesType
-      movingScales( simmer->GetNumberOfParameters() );
-      shiftScaleEstimator->EstimateScales( movingScales );
-      mstartOptimizer->SetScales( movingScales );
-      mstartOptimizer->SetMetric( gcmetric );
-      localoptimizer->SetMetric( gcmetric );
-      localoptimizer->SetScales( movingScales );
-    }
-    typename OptimizerType::ParametersListType parametersList =
-      mstartOptimizer->GetParametersList();
-    affinesearch->SetIdentity();
-    affinesearch->SetCenter( trans2 );
-    affinesearch->SetOffset( trans );
-    for ( unsigned int i = 0; i < thetas.size(); i++ )
-      {
-      RealType ang1 = thetas[i];
-      RealType ang2 = 0; // FIXME should be psi
-      RealType ang3 = 0; // FIXME should be psi
-      if( ImageDimension == 3 )
+      std::string txfn = "";
+      if ( j < static_cast< unsigned int >( txfns.size() ) )
         {
-        for ( unsigned int jj = 0; jj < thetas2.size(); jj++ )
-        {
-        ang2=thetas2[jj];
-        for ( unsigned int kk = 0; kk < thetas3.size(); kk++ )
-        {
-        ang3=thetas3[kk];
-        affinesearch->SetIdentity();
-        affinesearch->SetCenter( trans2 );
-        affinesearch->SetOffset( trans );
-        if( useprincaxis )
-          {
-          affinesearch->SetMatrix( A_solution );
-          }
-        affinesearch->Rotate3D(axis1, ang1, 1);
-        affinesearch->Rotate3D(axis2, ang2, 1);
-        affinesearch->Rotate3D(axis3, ang3, 1);
-//        affinesearch->Scale( bestscale ); // BUG: annoying, cant do for rigid
-        simmer->SetMatrix(  affinesearch->GetMatrix() );
-        parametersList.push_back( simmer->GetParameters() );
-        } // kk
-        }
-        }
-      if( ImageDimension == 2 )
-        {
-        affinesearch->SetIdentity();
-        affinesearch->SetCenter( trans2 );
-        affinesearch->SetOffset( trans );
-        if( useprincaxis )
-          {
-          affinesearch->SetMatrix( A_solution );
-          }
-        affinesearch->Rotate2D( ang1, 1);
-//        affinesearch->Scale( bestscale );
-        simmer->SetMatrix(  affinesearch->GetMatrix() );
-        typename AffineType::ParametersType pp =
-          simmer->GetParameters();
-        parametersList.push_back( simmer->GetParameters() );
+        txfn = Rcpp::as< std::string >( txfns[ j ] );
         }
+      outList[ j ] = invariantSimilarityResultMatrix<ImageDimension,
+        AffineType>( jobs[ j ], txfn );
       }
-    mstartOptimizer->SetParametersList( parametersList );
-    if( localSearchIterations > 0 )
-      {
-      mstartOptimizer->SetLocalOptimizer( localoptimizer );
-      }
-    mstartOptimizer->StartOptimization();
-    typename AffineType::Pointer bestaffine = AffineType::New();
-    bestaffine->SetCenter( trans2 );
-    bestaffine->SetParameters( mstartOptimizer->GetBestParameters() );
-    if ( txfn.length() > 3 )
-      {
-      typename AffineType::Pointer bestaffine = AffineType::New();
-      bestaffine->SetCenter( trans2 );
-      bestaffine->SetParameters( mstartOptimizer->GetBestParameters() );
-      typedef itk::TransformFileWriter TransformWriterType;
-      typename TransformWriterType::Pointer transformWriter =
-        TransformWriterType::New();
-      transformWriter->SetInput( bestaffine );
-      transformWriter->SetFileName( txfn.c_str() );
-      transformWriter->Update();
-      }
-    metricvalues = mstartOptimizer->GetMetricValuesList();
-    unsigned int ncols = mstartOptimizer->GetBestParameters().Size() +
-      1 + ImageDimension;
-    Rcpp::NumericMatrix outMat( metricvalues.size(), ncols );
-    for ( unsigned int k = 0; k < metricvalues.size(); k++ )
-      {
-      outMat( k, 0 ) = metricvalues[ k ];
-      typename MetricType::ParametersType resultParams =
-        mstartOptimizer->GetParametersList( )[ k ];
-      for ( unsigned int kp = 0; kp < resultParams.Size(); kp++ )
-        {
-        outMat( k, kp + 1 ) = resultParams[ kp ];
-        }
-      // set the fixed parameters
-      unsigned int baseind = resultParams.Size() + 1;
-      for ( unsigned int kp = 0; kp < ImageDimension; kp++ )
-        outMat( k, baseind + kp ) = bestaffine->GetFixedParameters()[ kp ];
+    else
+      {
+      Rcpp::NumericMatrix outMat( 1, 1 );
+      outMat( 0, 0 ) = 0;
+      outList[ j ] = outMat;
       }
-    return Rcpp::wrap( outMat );
-    }
-  else
-    {
-    Rcpp::NumericMatrix outMat( 1, 1 );
-    outMat( 0, 0 ) = 0;
-    return Rcpp::wrap( outMat );
     }
+  return Rcpp::wrap( outList );
 }
 
 // [[myRcpp::export]]
@@ -529,7 +1596,11 @@ RcppExport SEXP invariantImageSimilarity( SEXP r_in_image1 ,
   SEXP r_in_image2, SEXP thetas, SEXP thetas2, SEXP thetas3,
   SEXP localSearchIterations,
   SEXP whichMetric, SEXP r_scale, SEXP r_doref, SEXP txfn,
-  SEXP whichTransform, SEXP r_mask )
+  SEXP whichTransform, SEXP r_mask, SEXP shrinkFactors, SEXP topK,
+  SEXP samplingStrategy, SEXP samplingPercentage, SEXP r_context,
+  SEXP fftTranslation, SEXP pruning, SEXP leanEvaluator )
+{
+try
 {
   if( r_in_image1 == NULL || r_in_image2 == NULL )
     {
@@ -573,24 +1644,29 @@ RcppExport SEXP invariantImageSimilarity( SEXP r_in_image1 ,
       static_cast< SEXP >( in_image2.slot( "pointer" ) ) ) ;
     Rcpp::XPtr< ImagePointerType > mask_xptr(
         static_cast< SEXP >( in_mask.slot( "pointer" ) ) ) ;
+    InvariantSimilarityFixedContext< 2 > localContext;
+    const InvariantSimilarityFixedContext< 2 > * context =
+      invariantSimilarityGetFixedContext<2>( r_context, localContext,
+        *antsimage_xptr1, *mask_xptr, shrinkFactors, samplingStrategy,
+        samplingPercentage );
     if ( whichTx == 0 )
       return Rcpp::wrap( invariantSimilarityHelper<2,AffineType2D>(
-        *antsimage_xptr1, *antsimage_xptr2, thetas,
+        *context, *antsimage_xptr2, thetas,
         thetas2, thetas3,
         localSearchIterations, whichMetric, r_scale,
-        r_doref, txfn, *mask_xptr  ) );
+        r_doref, txfn, topK, fftTranslation, pruning, leanEvaluator ) );
     if ( whichTx == 1 )
       return Rcpp::wrap( invariantSimilarityHelper<2,SimilarityType2D>(
-        *antsimage_xptr1, *antsimage_xptr2, thetas,
+        *context, *antsimage_xptr2, thetas,
         thetas2, thetas3,
         localSearchIterations, whichMetric, r_scale,
-        r_doref, txfn, *mask_xptr  ) );
+        r_doref, txfn, topK, fftTranslation, pruning, leanEvaluator ) );
     if ( whichTx == 2 )
       return Rcpp::wrap( invariantSimilarityHelper<2,RigidType2D>(
-        *antsimage_xptr1, *antsimage_xptr2, thetas,
+        *context, *antsimage_xptr2, thetas,
         thetas2, thetas3,
         localSearchIterations, whichMetric, r_scale,
-        r_doref, txfn, *mask_xptr  ) );
+        r_doref, txfn, topK, fftTranslation, pruning, leanEvaluator ) );
   }
   else if ( dimension == 3 )
     {
@@ -602,24 +1678,29 @@ RcppExport SEXP invariantImageSimilarity( SEXP r_in_image1 ,
     static_cast< SEXP >( in_image2.slot( "pointer" ) ) ) ;
     Rcpp::XPtr< ImagePointerType3 > mask_xptr(
         static_cast< SEXP >( in_mask.slot( "pointer" ) ) ) ;
+    InvariantSimilarityFixedContext< 3 > localContext;
+    const InvariantSimilarityFixedContext< 3 > * context =
+      invariantSimilarityGetFixedContext<3>( r_context, localContext,
+        *antsimage_xptr1_3, *mask_xptr, shrinkFactors, samplingStrategy,
+        samplingPercentage );
     if ( whichTx == 0 )
       return Rcpp::wrap(  invariantSimilarityHelper<3,AffineType3D>(
-        *antsimage_xptr1_3, *antsimage_xptr2_3, thetas,
+        *context, *antsimage_xptr2_3, thetas,
         thetas2, thetas3,
         localSearchIterations, whichMetric, r_scale,
-        r_doref, txfn , *mask_xptr ) );
+        r_doref, txfn, topK, fftTranslation, pruning, leanEvaluator ) );
     if ( whichTx == 1 )
       return Rcpp::wrap(  invariantSimilarityHelper<3,SimilarityType3D>(
-        *antsimage_xptr1_3, *antsimage_xptr2_3, thetas,
+        *context, *antsimage_xptr2_3, thetas,
         thetas2, thetas3,
         localSearchIterations, whichMetric, r_scale,
-        r_doref, txfn , *mask_xptr ) );
+        r_doref, txfn, topK, fftTranslation, pruning, leanEvaluator ) );
     if ( whichTx == 2 )
       return Rcpp::wrap(  invariantSimilarityHelper<3,RigidType3D>(
-        *antsimage_xptr1_3, *antsimage_xptr2_3, thetas,
+        *context, *antsimage_xptr2_3, thetas,
         thetas2, thetas3,
         localSearchIterations, whichMetric, r_scale,
-        r_doref, txfn , *mask_xptr ) );
+        r_doref, txfn, topK, fftTranslation, pruning, leanEvaluator ) );
     }
   else if ( dimension == 4 )
     {
@@ -631,12 +1712,17 @@ RcppExport SEXP invariantImageSimilarity( SEXP r_in_image1 ,
     static_cast< SEXP >( in_image2.slot( "pointer" ) ) ) ;
     Rcpp::XPtr< ImagePointerType4 > mask_xptr(
         static_cast< SEXP >( in_mask.slot( "pointer" ) ) );
+    InvariantSimilarityFixedContext< 4 > localContext;
+    const InvariantSimilarityFixedContext< 4 > * context =
+      invariantSimilarityGetFixedContext<4>( r_context, localContext,
+        *antsimage_xptr1_4, *mask_xptr, shrinkFactors, samplingStrategy,
+        samplingPercentage );
     if ( whichTx == 0 )
       return Rcpp::wrap(  invariantSimilarityHelper<4,AffineType4D>(
-        *antsimage_xptr1_4, *antsimage_xptr2_4, thetas,
+        *context, *antsimage_xptr2_4, thetas,
         thetas2, thetas3,
         localSearchIterations, whichMetric, r_scale,
-        r_doref, txfn, *mask_xptr  ) );
+        r_doref, txfn, topK, fftTranslation, pruning, leanEvaluator ) );
     if ( ( whichTx == 1 ) || ( whichTx == 2 ) )
       {
       Rcpp::Rcout << " In dimension " << dimension <<
@@ -648,29 +1734,507 @@ RcppExport SEXP invariantImageSimilarity( SEXP r_in_image1 ,
     " is not supported " << std::endl;
   return Rcpp::wrap( 1 );
 }
+catch( itk::ExceptionObject & err )
+{
+  Rcpp::Rcout << "ITK ExceptionObject caught!" << std::endl;
+  forward_exception_to_r( err );
+}
+catch( const std::exception& exc )
+{
+  Rcpp::Rcout << "STD ExceptionObject caught!" << std::endl;
+  forward_exception_to_r( exc );
+}
+catch( ... )
+{
+  Rcpp::stop( "C++ exception (unknown reason)");
+}
+ return Rcpp::wrap(NA_REAL); // should not be reached
+}
+
+
+// [[myRcpp::export]]
+RcppExport SEXP invariantImageSimilarityBatch( SEXP r_in_image1,
+  SEXP r_movingImages, SEXP thetas, SEXP thetas2, SEXP thetas3,
+  SEXP localSearchIterations,
+  SEXP whichMetric, SEXP r_scale, SEXP r_doref, SEXP txfns,
+  SEXP whichTransform, SEXP r_mask, SEXP shrinkFactors, SEXP topK,
+  SEXP samplingStrategy, SEXP samplingPercentage, SEXP r_context,
+  SEXP fftTranslation, SEXP pruning, SEXP leanEvaluator )
+{
+try
+{
+  Rcpp::S4 in_image1( r_in_image1 ) ;
+  Rcpp::S4 in_mask( r_mask ) ;
+  Rcpp::List movingImages( r_movingImages );
+  std::string in_pixeltype = Rcpp::as< std::string >(
+    in_image1.slot( "pixeltype" ) ) ;
+  unsigned int dimension = Rcpp::as< unsigned int >(
+    in_image1.slot( "dimension" ) ) ;
+  for ( R_xlen_t j = 0; j < movingImages.size(); j++ )
+    {
+    Rcpp::S4 in_image2( movingImages[ j ] );
+    if ( ( Rcpp::as< unsigned int >( in_image2.slot( "dimension" ) ) !=
+           dimension ) ||
+         ( Rcpp::as< std::string >( in_image2.slot( "pixeltype" ) ).compare(
+           in_pixeltype ) != 0 ) )
+      {
+      Rcpp::stop( "Images must have equivalent dimensionality & pixel type" );
+      }
+    }
+  typedef itk::AffineTransform<double, 2> AffineType2D;
+  typedef itk::AffineTransform<double, 3> AffineType3D;
+  typedef itk::Similarity2DTransform<double> SimilarityType2D;
+  typedef itk::Similarity3DTransform<double> SimilarityType3D;
+  typedef itk::Euler2DTransform<double> RigidType2D;
+  typedef itk::Euler3DTransform<double> RigidType3D;
+  // 0=affine, 1 = similarity, 2 = rigid
+  unsigned int whichTx = Rcpp::as< unsigned int >( whichTransform );
+  if ( dimension == 2 )
+    {
+    typedef itk::Image< float , 2 > ImageType;
+    typedef ImageType::Pointer ImagePointerType;
+    Rcpp::XPtr< ImagePointerType > antsimage_xptr1(
+      static_cast< SEXP >( in_image1.slot( "pointer" ) ) ) ;
+    Rcpp::XPtr< ImagePointerType > mask_xptr(
+      static_cast< SEXP >( in_mask.slot( "pointer" ) ) ) ;
+    InvariantSimilarityFixedContext< 2 > localContext;
+    const InvariantSimilarityFixedContext< 2 > * context =
+      invariantSimilarityGetFixedContext<2>( r_context, localContext,
+        *antsimage_xptr1, *mask_xptr, shrinkFactors, samplingStrategy,
+        samplingPercentage );
+    if ( whichTx == 0 )
+      return invariantSimilarityBatchHelper<2,AffineType2D>( *context,
+        r_movingImages, thetas, thetas2, thetas3, localSearchIterations,
+        whichMetric, r_scale, r_doref, txfns, topK, fftTranslation,
+        pruning, leanEvaluator );
+    if ( whichTx == 1 )
+      return invariantSimilarityBatchHelper<2,SimilarityType2D>( *context,
+        r_movingImages, thetas, thetas2, thetas3, localSearchIterations,
+        whichMetric, r_scale, r_doref, txfns, topK, fftTranslation,
+        pruning, leanEvaluator );
+    if ( whichTx == 2 )
+      return invariantSimilarityBatchHelper<2,RigidType2D>( *context,
+        r_movingImages, thetas, thetas2, thetas3, localSearchIterations,
+        whichMetric, r_scale, r_doref, txfns, topK, fftTranslation,
+        pruning, leanEvaluator );
+    }
+  else if ( dimension == 3 )
+    {
+    typedef itk::Image< float , 3 > ImageType3;
+    typedef ImageType3::Pointer ImagePointerType3;
+    Rcpp::XPtr< ImagePointerType3 > antsimage_xptr1_3(
+      static_cast< SEXP >( in_image1.slot( "pointer" ) ) ) ;
+    Rcpp::XPtr< ImagePointerType3 > mask_xptr(
+      static_cast< SEXP >( in_mask.slot( "pointer" ) ) ) ;
+    InvariantSimilarityFixedContext< 3 > localContext;
+    const InvariantSimilarityFixedContext< 3 > * context =
+      invariantSimilarityGetFixedContext<3>( r_context, localContext,
+        *antsimage_xptr1_3, *mask_xptr, shrinkFactors, samplingStrategy,
+        samplingPercentage );
+    if ( whichTx == 0 )
+      return invariantSimilarityBatchHelper<3,AffineType3D>( *context,
+        r_movingImages, thetas, thetas2, thetas3, localSearchIterations,
+        whichMetric, r_scale, r_doref, txfns, topK, fftTranslation,
+        pruning, leanEvaluator );
+    if ( whichTx == 1 )
+      return invariantSimilarityBatchHelper<3,SimilarityType3D>( *context,
+        r_movingImages, thetas, thetas2, thetas3, localSearchIterations,
+        whichMetric, r_scale, r_doref, txfns, topK, fftTranslation,
+        pruning, leanEvaluator );
+    if ( whichTx == 2 )
+      return invariantSimilarityBatchHelper<3,RigidType3D>( *context,
+        r_movingImages, thetas, thetas2, thetas3, localSearchIterations,
+        whichMetric, r_scale, r_doref, txfns, topK, fftTranslation,
+        pruning, leanEvaluator );
+    }
+  Rcpp::stop( "Unsupported image dimension or transform." );
+}
+catch( itk::ExceptionObject & err )
+{
+  Rcpp::Rcout << "ITK ExceptionObject caught!" << std::endl;
+  forward_exception_to_r( err );
+}
+catch( const std::exception& exc )
+{
+  Rcpp::Rcout << "STD ExceptionObject caught!" << std::endl;
+  forward_exception_to_r( exc );
+}
+catch( ... )
+{
+  Rcpp::stop( "C++ exception (unknown reason)");
+}
+ return Rcpp::wrap(NA_REAL); // should not be reached
+}
+
+template< unsigned int ImageDimension >
+SEXP invariantSimilarityFixedContextHelper( SEXP r_in_image1, SEXP r_mask,
+  SEXP shrinkFactors, SEXP samplingStrategy, SEXP samplingPercentage )
+{
+  typedef itk::Image< float , ImageDimension > ImageType;
+  typedef typename ImageType::Pointer ImagePointerType;
+  typedef InvariantSimilarityFixedContext< ImageDimension > ContextType;
+  Rcpp::S4 in_image1( r_in_image1 ) ;
+  Rcpp::S4 in_mask( r_mask ) ;
+  Rcpp::XPtr< ImagePointerType > antsimage_xptr1(
+    static_cast< SEXP >( in_image1.slot( "pointer" ) ) ) ;
+  Rcpp::XPtr< ImagePointerType > mask_xptr(
+    static_cast< SEXP >( in_mask.slot( "pointer" ) ) ) ;
+  ContextType * context = new ContextType;
+  invariantSimilarityBuildFixedContext<ImageDimension>( *context,
+    *antsimage_xptr1, *mask_xptr, shrinkFactors, samplingStrategy,
+    samplingPercentage );
+  Rcpp::XPtr< ContextType > context_xptr( context, true );
+  return context_xptr;
+}
+
+// [[myRcpp::export]]
+RcppExport SEXP invariantImageSimilarityFixedContext( SEXP r_in_image1,
+  SEXP r_mask, SEXP shrinkFactors, SEXP samplingStrategy,
+  SEXP samplingPercentage )
+{
+try
+{
+  Rcpp::S4 in_image1( r_in_image1 ) ;
+  unsigned int dimension = Rcpp::as< unsigned int >(
+    in_image1.slot( "dimension" ) ) ;
+  if ( dimension == 2 )
+    return invariantSimilarityFixedContextHelper<2>( r_in_image1, r_mask,
+      shrinkFactors, samplingStrategy, samplingPercentage );
+  else if ( dimension == 3 )
+    return invariantSimilarityFixedContextHelper<3>( r_in_image1, r_mask,
+      shrinkFactors, samplingStrategy, samplingPercentage );
+  else if ( dimension == 4 )
+    return invariantSimilarityFixedContextHelper<4>( r_in_image1, r_mask,
+      shrinkFactors, samplingStrategy, samplingPercentage );
+  else Rcpp::stop( "Unsupported image dimension." );
+}
+catch( itk::ExceptionObject & err )
+{
+  Rcpp::Rcout << "ITK ExceptionObject caught!" << std::endl;
+  forward_exception_to_r( err );
+}
+catch( const std::exception& exc )
+{
+  Rcpp::Rcout << "STD ExceptionObject caught!" << std::endl;
+  forward_exception_to_r( exc );
+}
+catch( ... )
+{
+  Rcpp::stop( "C++ exception (unknown reason)");
+}
+ return Rcpp::wrap(NA_REAL); // should not be reached
+}
+
+
+template< class FilterType, class ImageType >
+typename ImageType::Pointer convolveImageFilter(
+  const ImageType * image,
+  const ImageType * kernel,
+  bool validRegion,
+  bool zeroBoundary )
+{
+  itk::ConstantBoundaryCondition< ImageType > zero;
+  typename FilterType::Pointer convolutionFilter = FilterType::New();
+  convolutionFilter->SetInput( image );
+  convolutionFilter->SetKernelImage( kernel );
+  if ( validRegion )
+    {
+    convolutionFilter->SetOutputRegionModeToValid();
+    }
+  if ( zeroBoundary )
+    {
+    convolutionFilter->SetBoundaryCondition( &zero );
+    }
+  convolutionFilter->Update();
+  return convolutionFilter->GetOutput();
+}
+
+template< class ImageType >
+typename ImageType::Pointer convolveImageDomain(
+  const ImageType * image,
+  const ImageType * kernel,
+  bool useFFT,
+  bool validRegion,
+  bool zeroBoundary )
+{
+  if ( useFFT )
+    {
+    return convolveImageFilter< itk::FFTConvolutionImageFilter< ImageType > >(
+      image, kernel, validRegion, zeroBoundary );
+    }
+  return convolveImageFilter< itk::ConvolutionImageFilter< ImageType > >(
+    image, kernel, validRegion, zeroBoundary );
+}
+
+/** One 1-D pass of a separable convolution along axis.  Each line is
+ * copied into a padded buffer so that the inner loop runs over contiguous
+ * samples; the lines are shared between threads. */
+template< class ImageType >
+void convolveImageAxis(
+  const ImageType * input,
+  ImageType * output,
+  unsigned int axis,
+  const std::vector< double > & kernel,
+  bool zeroBoundary )
+{
+  const typename ImageType::SizeType size =
+    input->GetBufferedRegion().GetSize();
+  unsigned long stride = 1;
+  for ( unsigned int d = 0; d < axis; d++ )
+    {
+    stride *= size[ d ];
+    }
+  const long length = size[ axis ];
+  const long radius = kernel.size() / 2;
+  const unsigned int numberOfLines =
+    input->GetBufferedRegion().GetNumberOfPixels() / length;
+  // reversed so that the pass is a correlation with the padded line
+  const std::vector< double > flipped( kernel.rbegin(), kernel.rend() );
+  const typename ImageType::PixelType * in = input->GetBufferPointer();
+  typename ImageType::PixelType * out = output->GetBufferPointer();
+  invariantSimilarityRunWorkers( numberOfLines,
+    [&]( std::atomic< unsigned int > & nextLine )
+    {
+    std::vector< double > padded( length + 2 * radius );
+    std::vector< double > result( length );
+    for ( unsigned int line = nextLine++; line < numberOfLines;
+          line = nextLine++ )
+      {
+      const unsigned long base =
+        ( line / stride ) * stride * length + line % stride;
+      for ( long i = 0; i < length + 2 * radius; i++ )
+        {
+        long j = i - radius;
+        if ( j < 0 || j >= length )
+          {
+          if ( zeroBoundary )
+            {
+            padded[ i ] = 0;
+            continue;
+            }
+          j = std::min( length - 1, std::max( 0L, j ) );
+          }
+        padded[ i ] = in[ base + j * stride ];
+        }
+      std::fill( result.begin(), result.end(), 0.0 );
+      for ( unsigned int k = 0; k < flipped.size(); k++ )
+        {
+        const double w = flipped[ k ];
+        const double * source = &padded[ k ];
+        double * target = &result[ 0 ];
+        for ( long i = 0; i < length; i++ )
+          {
+          target[ i ] += w * source[ i ];
+          }
+        }
+      for ( long i = 0; i < length; i++ )
+        {
+        out[ base + i * stride ] = result[ i ];
+        }
+      }
+    } );
+}
+
+/** Convolve with the outer product of kernels, one odd length 1-D kernel
+ * per axis, as successive 1-D passes. */
+template< class ImageType >
+typename ImageType::Pointer convolveImageSeparable(
+  const ImageType * image,
+  const std::vector< std::vector< double > > & kernels,
+  bool validRegion,
+  bool zeroBoundary )
+{
+  typename ImageType::Pointer input = const_cast< ImageType * >( image );
+  for ( unsigned int d = 0; d < ImageType::ImageDimension; d++ )
+    {
+    typename ImageType::Pointer output = ImageType::New();
+    output->CopyInformation( image );
+    output->SetRegions( image->GetBufferedRegion() );
+    output->Allocate();
+    convolveImageAxis< ImageType >( input, output, d, kernels[ d ],
+      zeroBoundary );
+    input = output;
+    }
+  if ( !validRegion )
+    {
+    return input;
+    }
+  // the same region ConvolutionImageFilter keeps in valid mode
+  typename ImageType::RegionType region = image->GetBufferedRegion();
+  for ( unsigned int d = 0; d < ImageType::ImageDimension; d++ )
+    {
+    const long radius = kernels[ d ].size() / 2;
+    region.SetIndex( d, region.GetIndex( d ) + radius );
+    region.SetSize( d, region.GetSize( d ) - 2 * radius );
+    }
+  typedef itk::ExtractImageFilter< ImageType, ImageType > ExtractFilterType;
+  typename ExtractFilterType::Pointer extractor = ExtractFilterType::New();
+  extractor->SetInput( input );
+  extractor->SetExtractionRegion( region );
+  extractor->SetDirectionCollapseToSubmatrix();
+  extractor->Update();
+  return extractor->GetOutput();
+}
 
+/** Factor kernel into one 1-D kernel per axis if it is, to single
+ * precision, the outer product of odd length vectors. */
+template< class ImageType >
+bool convolveImageFactorKernel(
+  const ImageType * kernel,
+  std::vector< std::vector< double > > & kernels )
+{
+  typedef itk::ImageRegionConstIteratorWithIndex< ImageType > IteratorType;
+  const typename ImageType::RegionType region =
+    kernel->GetLargestPossibleRegion();
+  for ( unsigned int d = 0; d < ImageType::ImageDimension; d++ )
+    {
+    if ( region.GetSize( d ) % 2 == 0 )
+      {
+      return false;
+      }
+    }
+  IteratorType it( kernel, region );
+  typename ImageType::IndexType peakIndex = region.GetIndex();
+  double peak = 0;
+  for ( it.GoToBegin(); !it.IsAtEnd(); ++it )
+    {
+    if ( std::abs( it.Get() ) > std::abs( peak ) )
+      {
+      peak = it.Get();
+      peakIndex = it.GetIndex();
+      }
+    }
+  if ( peak == 0 )
+    {
+    return false;
+    }
+  // the lines through the peak, with the repeated peak factors folded
+  // into the first one
+  kernels.assign( ImageType::ImageDimension, std::vector< double >() );
+  for ( unsigned int d = 0; d < ImageType::ImageDimension; d++ )
+    {
+    typename ImageType::IndexType index = peakIndex;
+    for ( unsigned long i = 0; i < region.GetSize( d ); i++ )
+      {
+      index[ d ] = region.GetIndex( d ) + i;
+      kernels[ d ].push_back( kernel->GetPixel( index ) );
+      }
+    }
+  const double scale = std::pow( peak, 1.0 - ImageType::ImageDimension );
+  for ( unsigned long i = 0; i < kernels[ 0 ].size(); i++ )
+    {
+    kernels[ 0 ][ i ] *= scale;
+    }
+  for ( it.GoToBegin(); !it.IsAtEnd(); ++it )
+    {
+    double value = 1;
+    for ( unsigned int d = 0; d < ImageType::ImageDimension; d++ )
+      {
+      value *= kernels[ d ][ it.GetIndex()[ d ] - region.GetIndex( d ) ];
+      }
+    if ( std::abs( value - it.Get() ) > 1.e-6 * std::abs( peak ) )
+      {
+      return false;
+      }
+    }
+  return true;
+}
 
+/** method is "spatial", "fft", "separable" or "auto".  "auto" uses 1-D
+ * passes when the kernel factors and otherwise picks the FFT once the
+ * kernel has more than fftThreshold voxels.  A non-empty kernels1D gives
+ * the factors directly and kernel is then ignored.  mode is "same",
+ * "valid" or "normalized"; the latter treats the outside of the image as
+ * missing rather than as zero flux, dividing the zero padded convolution
+ * by the part of the kernel mass that falls inside the image. */
 template< class ImageType >
 typename ImageType::Pointer convolveImageHelper(
   typename ImageType::Pointer image,
-  typename ImageType::Pointer kernel )
+  typename ImageType::Pointer kernel,
+  std::vector< std::vector< double > > kernels1D,
+  const std::string & method,
+  const std::string & mode,
+  unsigned long fftThreshold )
 {
-  enum { Dimension = ImageType::ImageDimension };
-  if( image.IsNotNull() & kernel.IsNotNull() )
+  if( image.IsNull() || ( kernel.IsNull() && kernels1D.empty() ) )
+    {
+    return nullptr;
+    }
+  bool separable = !kernels1D.empty();
+  if ( !separable && ( method.compare( "auto" ) == 0 ||
+                       method.compare( "separable" ) == 0 ) )
+    {
+    separable = convolveImageFactorKernel< ImageType >( kernel, kernels1D );
+    if ( !separable && method.compare( "separable" ) == 0 )
+      {
+      itkGenericExceptionMacro( "the kernel is not separable" );
+      }
+    }
+  const bool useFFT = !separable && ( ( method.compare( "fft" ) == 0 ) ||
+    ( method.compare( "auto" ) == 0 &&
+      kernel->GetLargestPossibleRegion().GetNumberOfPixels() > fftThreshold ) );
+  const bool normalized = ( mode.compare( "normalized" ) == 0 );
+  const bool validRegion = ( mode.compare( "valid" ) == 0 );
+  auto convolve = [&]( const ImageType * input, bool zeroBoundary )
+    -> typename ImageType::Pointer
+    {
+    if ( separable )
+      {
+      return convolveImageSeparable< ImageType >( input, kernels1D,
+        validRegion, zeroBoundary );
+      }
+    return convolveImageDomain< ImageType >( input, kernel, useFFT,
+      validRegion, zeroBoundary );
+    };
+  if ( !normalized )
+    {
+    return convolve( image, false );
+    }
+
+  typename ImageType::Pointer ones = ImageType::New();
+  ones->CopyInformation( image );
+  ones->SetRegions( image->GetLargestPossibleRegion() );
+  ones->Allocate();
+  ones->FillBuffer( 1 );
+  typename ImageType::Pointer numerator = convolve( image, true );
+  typename ImageType::Pointer denominator = convolve( ones, true );
+  typedef itk::ImageRegionConstIterator< ImageType > ConstIteratorType;
+  double kernelMass = 0;
+  if ( separable )
+    {
+    kernelMass = 1;
+    for ( unsigned int d = 0; d < kernels1D.size(); d++ )
+      {
+      kernelMass *= std::accumulate( kernels1D[ d ].begin(),
+        kernels1D[ d ].end(), 0.0 );
+      }
+    }
+  else
+    {
+    ConstIteratorType kIt( kernel, kernel->GetLargestPossibleRegion() );
+    for ( kIt.GoToBegin(); !kIt.IsAtEnd(); ++kIt )
+      {
+      kernelMass += kIt.Get();
+      }
+    }
+  typedef itk::ImageRegionIterator< ImageType > IteratorType;
+  IteratorType nIt( numerator, numerator->GetLargestPossibleRegion() );
+  ConstIteratorType dIt( denominator, denominator->GetLargestPossibleRegion() );
+  for ( nIt.GoToBegin(), dIt.GoToBegin(); !nIt.IsAtEnd(); ++nIt, ++dIt )
     {
-    typedef itk::ConvolutionImageFilter<ImageType> FilterType;
-    typename FilterType::Pointer convolutionFilter = FilterType::New();
-    convolutionFilter->SetInput( image );
-    convolutionFilter->SetKernelImage( kernel );
-    convolutionFilter->Update();
-    return convolutionFilter->GetOutput();
+    const double weight = dIt.Get();
+    nIt.Set( std::abs( weight ) > 1.e-12 ?
+      nIt.Get() * kernelMass / weight : 0 );
     }
-  return nullptr;
+  return numerator;
 }
 
 // [[myRcpp::export]]
 RcppExport SEXP itkConvolveImage( SEXP r_in_image1 ,
-  SEXP r_in_image2  )
+  SEXP r_in_image2, SEXP r_method, SEXP r_mode, SEXP r_fftThreshold,
+  SEXP r_kernels1D )
+{
+try
 {
   if( r_in_image1 == NULL || r_in_image2 == NULL  )
     {
@@ -678,11 +2242,15 @@ RcppExport SEXP itkConvolveImage( SEXP r_in_image1 ,
     Rcpp::wrap( 1 ) ;
     }
   Rcpp::S4 in_image1( r_in_image1 ) ;
-  Rcpp::S4 in_image2( r_in_image2 ) ;
   std::string in_pixeltype = Rcpp::as< std::string >(
     in_image1.slot( "pixeltype" ) ) ;
   unsigned int dimension = Rcpp::as< unsigned int >(
     in_image1.slot( "dimension" ) ) ;
+  // the kernel image is NULL when its 1-D factors are given instead
+  const bool hasKernelImage = ( r_in_image2 != R_NilValue );
+  if ( hasKernelImage )
+  {
+  Rcpp::S4 in_image2( r_in_image2 ) ;
   std::string in_pixeltype2 = Rcpp::as< std::string >(
     in_image2.slot( "pixeltype" ) ) ;
   unsigned int dimension2 = Rcpp::as< unsigned int >(
@@ -693,6 +2261,24 @@ RcppExport SEXP itkConvolveImage( SEXP r_in_image1 ,
     Rcpp::Rcout << " Images must have equivalent dimensionality & pixel type" << std::endl ;
     Rcpp::wrap( 1 );
   }
+  }
+  std::string method = Rcpp::as< std::string >( r_method );
+  std::string mode = Rcpp::as< std::string >( r_mode );
+  unsigned long fftThreshold = Rcpp::as< unsigned long >( r_fftThreshold );
+  std::vector< std::vector< double > > kernels1D;
+  if ( r_kernels1D != R_NilValue )
+    {
+    Rcpp::List kernelList( r_kernels1D );
+    for ( int d = 0; d < kernelList.size(); d++ )
+      {
+      kernels1D.push_back(
+        Rcpp::as< std::vector< double > >( kernelList[ d ] ) );
+      }
+    if ( kernels1D.size() != dimension )
+      {
+      Rcpp::stop( "need one 1-D kernel per image dimension" );
+      }
+    }
 
   // make new out image, result of convolution
   Rcpp::S4 out_image( std::string( "antsImage" ) ) ;
@@ -705,13 +2291,19 @@ RcppExport SEXP itkConvolveImage( SEXP r_in_image1 ,
     typedef ImageType::Pointer ImagePointerType;
     Rcpp::XPtr< ImagePointerType > antsimage_xptr1(
       static_cast< SEXP >( in_image1.slot( "pointer" ) ) ) ;
-    Rcpp::XPtr< ImagePointerType > antsimage_xptr2(
-      static_cast< SEXP >( in_image2.slot( "pointer" ) ) ) ;
+    ImagePointerType kernel = nullptr;
+    if ( hasKernelImage )
+      {
+      Rcpp::S4 in_image2( r_in_image2 ) ;
+      Rcpp::XPtr< ImagePointerType > antsimage_xptr2(
+        static_cast< SEXP >( in_image2.slot( "pointer" ) ) ) ;
+      kernel = *antsimage_xptr2;
+      }
 
     ImagePointerType* out_image_ptr_ptr =
       new ImagePointerType(
         convolveImageHelper<ImageType>(
-          *antsimage_xptr1,*antsimage_xptr2 )
+          *antsimage_xptr1, kernel, kernels1D, method, mode, fftThreshold )
         );
 
     Rcpp::XPtr< ImagePointerType >
@@ -724,13 +2316,19 @@ RcppExport SEXP itkConvolveImage( SEXP r_in_image1 ,
     typedef ImageType::Pointer ImagePointerType;
     Rcpp::XPtr< ImagePointerType > antsimage_xptr1(
       static_cast< SEXP >( in_image1.slot( "pointer" ) ) ) ;
-    Rcpp::XPtr< ImagePointerType > antsimage_xptr2(
-      static_cast< SEXP >( in_image2.slot( "pointer" ) ) ) ;
+    ImagePointerType kernel = nullptr;
+    if ( hasKernelImage )
+      {
+      Rcpp::S4 in_image2( r_in_image2 ) ;
+      Rcpp::XPtr< ImagePointerType > antsimage_xptr2(
+        static_cast< SEXP >( in_image2.slot( "pointer" ) ) ) ;
+      kernel = *antsimage_xptr2;
+      }
 
     ImagePointerType* out_image_ptr_ptr =
       new ImagePointerType(
         convolveImageHelper<ImageType>(
-          *antsimage_xptr1,*antsimage_xptr2 )
+          *antsimage_xptr1, kernel, kernels1D, method, mode, fftThreshold )
         );
 
     Rcpp::XPtr< ImagePointerType >
@@ -744,13 +2342,19 @@ RcppExport SEXP itkConvolveImage( SEXP r_in_image1 ,
     typedef ImageType::Pointer ImagePointerType;
     Rcpp::XPtr< ImagePointerType > antsimage_xptr1(
       static_cast< SEXP >( in_image1.slot( "pointer" ) ) ) ;
-    Rcpp::XPtr< ImagePointerType > antsimage_xptr2(
-      static_cast< SEXP >( in_image2.slot( "pointer" ) ) ) ;
+    ImagePointerType kernel = nullptr;
+    if ( hasKernelImage )
+      {
+      Rcpp::S4 in_image2( r_in_image2 ) ;
+      Rcpp::XPtr< ImagePointerType > antsimage_xptr2(
+        static_cast< SEXP >( in_image2.slot( "pointer" ) ) ) ;
+      kernel = *antsimage_xptr2;
+      }
 
     ImagePointerType* out_image_ptr_ptr =
       new ImagePointerType(
         convolveImageHelper<ImageType>(
-          *antsimage_xptr1,*antsimage_xptr2 )
+          *antsimage_xptr1, kernel, kernels1D, method, mode, fftThreshold )
         );
 
     Rcpp::XPtr< ImagePointerType >
@@ -760,3 +2364,19 @@ RcppExport SEXP itkConvolveImage( SEXP r_in_image1 ,
     else Rcpp::Rcout << " Dimension " << dimension << " is not supported " << std::endl;
   return out_image;
 }
+catch( itk::ExceptionObject & err )
+{
+  Rcpp::Rcout << "ITK ExceptionObject caught!" << std::endl;
+  forward_exception_to_r( err );
+}
+catch( const std::exception& exc )
+{
+  Rcpp::Rcout << "STD ExceptionObject caught!" << std::endl;
+  forward_exception_to_r( exc );
+}
+catch( ... )
+{
+  Rcpp::stop( "C++ exception (unknown reason)");
+}
+ return Rcpp::wrap(NA_REAL); // should not be reached
+}
@@ -46,7 +46,14 @@
 #include "itkCovariantVector.h"
 #include "itkGradientRecursiveGaussianImageFilter.h"
 #include "itkBSplineInterpolateImageFunction.h"
+#include <vnl/algo/vnl_symmetric_eigensystem.h>
 #include "itkImageToImageFilter.h"
+#include "itkTimeProbesCollectorBase.h"
+#include "randomizedSVD.h"
+#include "eigenPatchBasis.h"
+#include "patchSphereOffsets.h"
+#include <vnl/vnl_matrix_ref.h>
+#include <memory>
 
 namespace itk {
 
@@ -175,7 +182,7 @@ public:
     InputImagePointer eigenvecMaskImage;
     eigenvecMaskImage = this->GenerateMaskImageFromPatch( );
     VectorType canonicalEigenPatchAsVector =
-        this->m_SignificantPatchEigenvectors.get_column( k );
+        this->GetEigenPatchBasis().get_column( k );
     InputImagePointer ivec = this->ConvertVectorToSpatialImage(
             canonicalEigenPatchAsVector, eigenvecMaskImage );
     return ivec;
@@ -230,6 +237,38 @@ public:
   itkBooleanMacro( LearnPatchBasis );
 
 
+  /**
+   * Learn the basis with a randomized truncated SVD that only computes the
+   * leading components instead of a full SVD of the sample patches.  With
+   * a TargetVarianceExplained below one the variance is then measured by
+   * the squared singular values.
+   * Default = false.
+   */
+  itkSetMacro( RandomizedSVD, bool );
+  itkGetConstMacro( RandomizedSVD, bool );
+  itkBooleanMacro( RandomizedSVD );
+
+  /**
+   * Take the orientation of every patch from one gradient of the whole
+   * input instead of a gradient of each patch image.  The frames are cached
+   * and reused by later updates with the same input, mask and radius.  The
+   * whole image gradient differs from the patch gradients near the patch
+   * border, so the rotation invariant features change slightly.
+   * Default = false.
+   */
+  itkSetMacro( CacheOrientationFrames, bool );
+  itkGetConstMacro( CacheOrientationFrames, bool );
+  itkBooleanMacro( CacheOrientationFrames );
+
+  /**
+   * Number of mask voxels whose patches are extracted, reoriented and
+   * projected at a time.  The full patch matrix is then never formed and
+   * PatchesForAllPointsWithinMask stays empty; zero keeps the whole matrix.
+   * Default = 0.
+   */
+  itkSetMacro( StreamingChunkSize, SizeValueType );
+  itkGetConstMacro( StreamingChunkSize, SizeValueType );
+
   /**
    * Number of samples to randomly select from the mask (FIXME replace with random mask).
    */
@@ -258,8 +297,30 @@ public:
   /**
    * Set or get the reference patch basis.
    */
-  itkSetMacro( SignificantPatchEigenvectors, vnlMatrixType );
-  itkGetConstMacro( SignificantPatchEigenvectors, vnlMatrixType );
+  void SetSignificantPatchEigenvectors( const vnlMatrixType & basis )
+    {
+    this->m_BasisMap.reset();
+    this->m_MappedBasis.reset();
+    this->m_SignificantPatchEigenvectors = basis;
+    this->Modified();
+    }
+  vnlMatrixType GetSignificantPatchEigenvectors() const
+    {
+    return this->GetEigenPatchBasis();
+    }
+
+  /**
+   * Save the basis with its radius, dimension, mean-centering and rotation
+   * invariance and the sphere index table, see eigenPatchBasis.h.
+   */
+  void WriteEigenPatchBasis( const std::string & fileName ) const;
+
+  /**
+   * Use the basis saved in fileName.  The file is mapped and, when it holds
+   * ComputationType values, used in place without a copy.  The radius and
+   * the flags are taken from the file and the basis is not learnt.
+   */
+  void ReadEigenPatchBasis( const std::string & fileName );
 
   /**
    * Set or get the patch basis for the full image.
@@ -296,14 +357,76 @@ public:
 
   InputImagePointer GenerateMaskImageFromPatch( );
 
+  /**
+   * Wall clock time of each phase of the last update: sample, learn,
+   * extract, reorient and project.
+   */
+  const TimeProbesCollectorBase & GetPhaseTimes() const
+    {
+    return this->m_PhaseTimes;
+    }
+
 protected:
   RIPMMARCImageFilter();
+
+  /** The basis in use: the mapped one from ReadEigenPatchBasis or the
+   * learnt or set one. */
+  const vnlMatrixType & GetEigenPatchBasis() const
+    {
+    if ( this->m_MappedBasis )
+      {
+      return *this->m_MappedBasis;
+      }
+    return this->m_SignificantPatchEigenvectors;
+    }
+
+  /** Check a given basis against the patch geometry of this filter. */
+  void VerifyEigenPatchBasis() const;
+
   ~RIPMMARCImageFilter() {}
 
   void PrintSelf( std::ostream & os, Indent indent ) const ITK_OVERRIDE;
 
   void GenerateData() ITK_OVERRIDE;
 
+  /** Reorient every row (or column) of patches to the canonical frame;
+   * column i holds the patch of mask voxel firstVoxel + i. */
+  void ReorientPatches( vnlMatrixType & patches, bool patchesInColumns,
+    SizeValueType firstVoxel = 0 );
+
+  /** Find the mask voxels, in buffer order. */
+  void CollectMaskIndices();
+
+  /** Fill the columns of patches with the patches of the mask voxels from
+   * firstVoxel on. */
+  void ExtractPatches( SizeValueType firstVoxel, vnlMatrixType & patches );
+
+  /** Write the coefficients and relative reconstruction errors of the
+   * patches of the mask voxels from firstVoxel on. */
+  void ProjectPatches( const vnlMatrixType & patches, SizeValueType firstVoxel,
+    const vnlMatrixType & pseudoInverse, VectorType & percentError );
+
+  /** Extract, reorient and project the mask in StreamingChunkSize chunks. */
+  void StreamAllPatches();
+
+  /** Fill the orientation frame cache for the mask voxels unless it is
+   * still valid for this input, mask and radius. */
+  void ComputeOrientationFrames();
+
+  /** The cached frame, eigenvectors by ascending eigenvalue in columns, of
+   * the patch centered at index; false if index is not in the mask. */
+  bool GetOrientationFrame( const IndexType & index, vnlMatrixType & frame ) const;
+
+  /** Rotate patch from movingFrame to fixedFrame about center. */
+  VectorType ReorientPatchWithFrames(
+    const VectorType & patch,
+    const VectorType & centeredCanonicalPatch,
+    const vnlMatrixType & fixedFrame,
+    const vnlMatrixType & movingFrame,
+    const std::vector< PointType > & points,
+    const PointType & center,
+    InterpPointer Interpolator );
+
   bool IsInside( GradientImagePointer input, IndexType index )
   {
     /** FIXME - should use StartIndex - */
@@ -329,22 +452,40 @@ private:
   bool                                        m_LearnPatchBasis;
   bool                                        m_ProjectOnEigenPatches;
   bool                                        m_Verbose;
+  bool                                        m_RandomizedSVD;
+  bool                                        m_CacheOrientationFrames;
   RealType                                    m_PatchRadius;
   RealType                                    m_TargetVarianceExplained;
   RealType                                    m_AchievedVarianceExplained;
 
   typename InputImageType::Pointer            m_CanonicalFrame; // frame to rotate all patches to
+  typename InputImageType::Pointer            m_ReorientationFrame; // frame the samples went to when streaming
   vnlMatrixType                               m_EigenvectorCoefficients;
   vnlMatrixType                               m_SignificantPatchEigenvectors;
+  std::shared_ptr< eigenPatchBasisMap >       m_BasisMap;
+  std::shared_ptr< vnl_matrix_ref< ComputationType > > m_MappedBasis;
   vnlMatrixType                               m_PatchesForAllPointsWithinMask;
   vnl_matrix< int >                           m_patchSeedPoints;
   vnlMatrixType                               m_vectorizedSamplePatchMatrix;
   std::vector< unsigned int >                 m_IndicesWithinSphere;
+  patchSphereOffsetTable< ImageDimension >    m_SphereOffsets;
   std::vector< ComputationType >                m_weights;
   long unsigned int                           m_numberOfVoxelsWithinMask;
   // amount of padding around eigenvector for constructing images
   unsigned int                                m_PaddingVoxels;
   unsigned int                                m_NumberOfSamplePatches;
+  SizeValueType                               m_StreamingChunkSize;
+  TimeProbesCollectorBase                     m_PhaseTimes;
+  std::vector< IndexType >                    m_MaskIndices;
+  // orientation frames of the mask voxels, row-major, by buffer offset
+  std::vector< OffsetValueType >              m_FrameOffsets;
+  std::vector< float >                        m_OrientationFrames;
+  const InputImageType *                      m_FrameCacheInput;
+  ModifiedTimeType                            m_FrameCacheInputTime;
+  const MaskImageType *                       m_FrameCacheMask;
+  ModifiedTimeType                            m_FrameCacheMaskTime;
+  RealType                                    m_FrameCacheRadius;
+  RealType                                    m_FrameCacheSigma;
 
 };
 
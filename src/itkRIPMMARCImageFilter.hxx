@@ -21,12 +21,14 @@
 #include "itkRIPMMARCImageFilter.h"
 
 #include "itkArray.h"
+#include "itkChangeInformationImageFilter.h"
 #include "itkDiscreteGaussianImageFilter.h"
 #include "itkImageRegionConstIterator.h"
 #include "itkImageRegionIterator.h"
 #include "itkImageRegionIteratorWithIndex.h"
 #include "itkMath.h"
 #include "itkMeanImageFilter.h"
+#include "itkMultiThreaderBase.h"
 #include "itkNeighborhoodIterator.h"
 #include "itkProgressReporter.h"
 #include "itkStatisticsImageFilter.h"
@@ -343,15 +345,25 @@ RIPMMARCImageFilter<TInputImage, TOutputImage, TComputation>
   m_LearnPatchBasis( true ),
   m_ProjectOnEigenPatches( true ),
   m_Verbose( true ),
+  m_RandomizedSVD( false ),
+  m_CacheOrientationFrames( false ),
   m_PatchRadius( 3 ),
   m_numberOfVoxelsWithinMask( 0 ),
   m_PaddingVoxels( 2 ),
-  m_NumberOfSamplePatches( 0 )
+  m_NumberOfSamplePatches( 0 ),
+  m_StreamingChunkSize( 0 )
 {
   this->SetNumberOfRequiredInputs( 2 ); // image of interest and mask
   this->m_TargetVarianceExplained = 0.95;
   this->m_AchievedVarianceExplained = 0.0;
   this->m_CanonicalFrame = ITK_NULLPTR;
+  this->m_ReorientationFrame = ITK_NULLPTR;
+  this->m_FrameCacheInput = ITK_NULLPTR;
+  this->m_FrameCacheInputTime = 0;
+  this->m_FrameCacheMask = ITK_NULLPTR;
+  this->m_FrameCacheMaskTime = 0;
+  this->m_FrameCacheRadius = 0;
+  this->m_FrameCacheSigma = 0;
 }
 
 template <typename TInputImage, typename TOutputImage, class TComputation>
@@ -398,62 +410,33 @@ template <typename TInputImage, typename TOutputImage, class TComputation>
 void RIPMMARCImageFilter<TInputImage, TOutputImage, TComputation>
 ::ExtractSamplePatches()
 {
-  // allocate matrix based on radial size of patch
-	int i = 0;
-	typename InputImageType::IndexType patchIndex;
-
-	for( int j = 0; j < ImageDimension; ++j)
+  const InputImageType * input = this->GetInput();
+	// get indices within N-d sphere, unless the table still fits
+	if ( !this->m_SphereOffsets.Matches( this->m_PatchRadius, input->GetOffsetTable() ) )
 	  {
-		patchIndex[ j ] = this->m_patchSeedPoints( i, j );
+		patchSphereOffsetTableCompute( this->m_PatchRadius, input->GetOffsetTable(),
+		  this->m_SphereOffsets );
 	  }
-  typename  InputImageType::ConstPointer input  = this->GetInput();
-  typedef typename itk::ConstNeighborhoodIterator< InputImageType > IteratorType;
-	typename IteratorType::RadiusType radius;
-	radius.Fill( this->m_PatchRadius );
-	IteratorType Iterator( radius, input, input->GetRequestedRegion() );
-	InputIndexType patchCenterIndex;
-	patchCenterIndex.Fill( this->m_PatchRadius ); // for finding indices within sphere, pick point far enough away from edges
-	Iterator.SetLocation( patchCenterIndex );
-
-	// get indices within N-d sphere
-	for( int ii = 0; ii < Iterator.Size(); ++ii)
-	{
-		InputIndexType index = Iterator.GetIndex( ii );
-		RealType distanceFromPatchCenter = 0.0;
-		for( int jj = 0; jj < ImageDimension; ++jj)
-		{
-			distanceFromPatchCenter +=
-					( index[jj] - patchCenterIndex[jj] ) *
-					( index[jj] - patchCenterIndex[jj] );
-		}
-		distanceFromPatchCenter = sqrt( distanceFromPatchCenter );
-		if( distanceFromPatchCenter <= this->m_PatchRadius )
-		{
-			this->m_IndicesWithinSphere.push_back( ii );
-			this->m_weights.push_back( 1.0 );
-		}
-	}
+	this->m_IndicesWithinSphere = this->m_SphereOffsets.neighborhoodIndices;
+	this->m_weights.assign( this->m_IndicesWithinSphere.size(), 1.0 );
   if ( this->m_Verbose ) {
-  	std::cout << "Iterator.Size() is " << Iterator.Size() << std::endl;
+  	std::cout << "Iterator.Size() is " << this->m_SphereOffsets.neighborhoodSize << std::endl;
 	  std::cout << "IndicesWithinSphere.size() is " << this->m_IndicesWithinSphere.size() << std::endl;
     }
 	// populate matrix with patch values from points in image
 	this->m_vectorizedSamplePatchMatrix.set_size(
 			this->m_NumberOfSamplePatches , this->m_IndicesWithinSphere.size() );
 	this->m_vectorizedSamplePatchMatrix.fill( 0 );
+	InputIndexType patchCenterIndex;
 	for( int i = 0; i < this->m_NumberOfSamplePatches ; ++i)
 	  {
 		for( int j = 0; j < ImageDimension; ++j)
 		  {
 			patchCenterIndex[ j ] = this->m_patchSeedPoints( i, j );
 		  }
-		Iterator.SetLocation( patchCenterIndex );
-		// get indices within N-d sphere
-		for( int j = 0; j < this->m_IndicesWithinSphere.size(); ++j)
-		  {
-			this->m_vectorizedSamplePatchMatrix( i, j ) =
-					Iterator.GetPixel( this->m_IndicesWithinSphere[ j ] );
-		  }
+		// the rows are contiguous, so the patch goes straight into its row
+		patchSphereGather( input, this->m_SphereOffsets, patchCenterIndex,
+		  this->m_vectorizedSamplePatchMatrix[ i ] );
 		// mean-center all patches
 		if( this->m_MeanCenterPatches ) {
 			this->m_vectorizedSamplePatchMatrix.set_row(i, this->m_vectorizedSamplePatchMatrix.get_row(i) -
@@ -465,13 +448,12 @@ void RIPMMARCImageFilter<TInputImage, TOutputImage, TComputation>
 
 template <typename TInputImage, typename TOutputImage, class TComputation>
 void RIPMMARCImageFilter<TInputImage, TOutputImage, TComputation>
-::ExtractAllPatches()
+::CollectMaskIndices()
 {
   const MaskImageType* mask = this->GetMaskImage();
-  typename  InputImageType::ConstPointer inputImage  = this->GetInput();
   // get indices of points within mask
-	IndexType patchIndex;
-	std::vector< IndexType > nonZeroMaskIndices;
+	std::vector< IndexType > & nonZeroMaskIndices = this->m_MaskIndices;
+	nonZeroMaskIndices.clear();
   itk::ImageRegionConstIterator<MaskImageType> maskImageIterator( mask,
                                             mask->GetLargestPossibleRegion() );
 	long unsigned int maskImagePointIter = 0;
@@ -485,7 +467,61 @@ void RIPMMARCImageFilter<TInputImage, TOutputImage, TComputation>
 	}
 	this->m_numberOfVoxelsWithinMask = maskImagePointIter;
 	if ( this->m_Verbose ) std::cout << "Number of points within mask is " << this->m_numberOfVoxelsWithinMask << std::endl;
+}
 
+template <typename TInputImage, typename TOutputImage, class TComputation>
+void RIPMMARCImageFilter<TInputImage, TOutputImage, TComputation>
+::ExtractPatches( SizeValueType firstVoxel, vnlMatrixType & patches )
+{
+  const InputImageType * inputImage = this->GetInput();
+  const unsigned int numberOfIndicesWithinSphere = this->m_IndicesWithinSphere.size();
+  const SizeValueType numberOfVoxels = patches.columns();
+  const SizeValueType numberOfChunks = std::max< SizeValueType >( 1,
+    std::min< SizeValueType >( this->GetNumberOfWorkUnits(), numberOfVoxels ) );
+  ComputationType * const * patchRows = patches.data_array();
+  // each work unit takes a range of mask indices and writes only the
+  // columns of that range
+  this->GetMultiThreader()->ParallelizeArray( 0, numberOfChunks,
+    [&]( SizeValueType chunk )
+    {
+    const SizeValueType first = chunk * numberOfVoxels / numberOfChunks;
+    const SizeValueType last = ( chunk + 1 ) * numberOfVoxels / numberOfChunks;
+    // the patch is gathered into a contiguous buffer so the mean and the
+    // centering are plain loops the compiler can vectorize
+    std::vector< ComputationType > patch( numberOfIndicesWithinSphere );
+    ComputationType * const values = patch.data();
+    for( SizeValueType i = first; i < last; ++i )
+      {
+      // get indices within N-d sphere
+      patchSphereGather( inputImage, this->m_SphereOffsets,
+        this->m_MaskIndices[ firstVoxel + i ], values );
+      // mean-center
+      if( this->m_MeanCenterPatches )
+        {
+        ComputationType sum = 0;
+        for( unsigned int j = 0; j < numberOfIndicesWithinSphere; ++j )
+          {
+          sum += values[ j ];
+          }
+        const ComputationType mean = sum / numberOfIndicesWithinSphere;
+        for( unsigned int j = 0; j < numberOfIndicesWithinSphere; ++j )
+          {
+          values[ j ] -= mean;
+          }
+        }
+      for( unsigned int j = 0; j < numberOfIndicesWithinSphere; ++j )
+        {
+        patchRows[ j ][ i ] = values[ j ];
+        }
+      }
+    }, ITK_NULLPTR );
+}
+
+template <typename TInputImage, typename TOutputImage, class TComputation>
+void RIPMMARCImageFilter<TInputImage, TOutputImage, TComputation>
+::ExtractAllPatches()
+{
+  this->CollectMaskIndices();
 	this->m_PatchesForAllPointsWithinMask.set_size(
 			this->m_IndicesWithinSphere.size(),  this->m_numberOfVoxelsWithinMask);
 	if( this->m_Verbose )
@@ -494,29 +530,7 @@ void RIPMMARCImageFilter<TInputImage, TOutputImage, TComputation>
 				this->m_PatchesForAllPointsWithinMask.columns() << "." << std::endl;
 	}
 	// extract patches
-	typedef typename itk::ConstNeighborhoodIterator< InputImageType > IteratorType;
-	typename IteratorType::RadiusType radius;
-	radius.Fill( this->m_PatchRadius );
-	IteratorType iterator( radius, inputImage,
-			inputImage->GetRequestedRegion() );
-	this->m_PatchesForAllPointsWithinMask.fill( 0 );
-	for( long unsigned int i = 0; i < this->m_numberOfVoxelsWithinMask; ++i)
-	{
-		patchIndex = nonZeroMaskIndices[ i ];
-		iterator.SetLocation( patchIndex );
-		// get indices within N-d sphere
-		for( int j = 0; j < this->m_IndicesWithinSphere.size(); ++j)
-		{
-			this->m_PatchesForAllPointsWithinMask( j, i ) =
-        iterator.GetPixel( this->m_IndicesWithinSphere[ j ] );
-		}
-		// mean-center
-		if( this->m_MeanCenterPatches ) {
-			this->m_PatchesForAllPointsWithinMask.set_column(i,
-					this->m_PatchesForAllPointsWithinMask.get_column(i) -
-					this->m_PatchesForAllPointsWithinMask.get_column(i).mean());
-		}
-	}
+  this->ExtractPatches( 0, this->m_PatchesForAllPointsWithinMask );
 	if( this->m_Verbose ) std::cout << "Recorded patches for all points." << std::endl;
 }
 
@@ -524,6 +538,29 @@ template <typename TInputImage, typename TOutputImage, class TComputation>
 void RIPMMARCImageFilter<TInputImage, TOutputImage, TComputation>
 ::LearnEigenPatches()
 {
+  // a learnt basis replaces one read from a file
+  this->m_BasisMap.reset();
+  this->m_MappedBasis.reset();
+  if ( this->m_RandomizedSVD )
+    {
+    const unsigned int maximumRank = std::min(
+      this->m_vectorizedSamplePatchMatrix.rows(),
+      this->m_vectorizedSamplePatchMatrix.cols() );
+    if ( this->m_TargetVarianceExplained > 1 )
+      if ( this->m_TargetVarianceExplained > maximumRank )
+        this->m_TargetVarianceExplained = maximumRank - 1;
+    VectorType singularValues;
+    double varianceExplained = 0;
+    this->m_SignificantPatchEigenvectors =
+      randomizedSVDRightSingularVectors< ComputationType >(
+        this->m_vectorizedSamplePatchMatrix, this->m_TargetVarianceExplained,
+        singularValues, varianceExplained );
+    this->m_AchievedVarianceExplained = varianceExplained;
+    if ( this->m_Verbose )
+      std::cout << "Randomized SVD kept " << this->m_SignificantPatchEigenvectors.cols() <<
+        " eigenvectors with " << varianceExplained * 100 << "% variance explained." << std::endl;
+    return;
+    }
   vnl_svd< ComputationType > svd( this->m_vectorizedSamplePatchMatrix );
 	vnlMatrixType patchEigenvectors = svd.V();
   RealType sumOfEigenvalues = 0.0;
@@ -581,72 +618,212 @@ void RIPMMARCImageFilter<TInputImage, TOutputImage, TComputation>
 
 template <typename TInputImage, typename TOutputImage, class TComputation>
 void RIPMMARCImageFilter<TInputImage, TOutputImage, TComputation>
-::ReorientSamplePatches()
+::ComputeOrientationFrames()
 {
-  typedef InputImageType ImageType;
-  RealType gradientSigma =                          1.0;
-  typename NeighborhoodIteratorType::RadiusType radius;
+  const InputImageType * input = this->GetInput();
+  const MaskImageType * mask = this->GetMaskImage();
+  const RealType gradientSigma = 1.0;
+  if ( this->m_FrameCacheInput == input &&
+       this->m_FrameCacheInputTime == input->GetMTime() &&
+       this->m_FrameCacheMask == mask &&
+       this->m_FrameCacheMaskTime == mask->GetMTime() &&
+       this->m_FrameCacheRadius == this->m_PatchRadius &&
+       this->m_FrameCacheSigma == gradientSigma &&
+       this->m_FrameOffsets.size() == this->m_MaskIndices.size() )
+    {
+    if ( this->m_Verbose ) std::cout << "Reusing cached orientation frames." << std::endl;
+    return;
+    }
 
-  GradientImageFilterPointer    movingGradientFilter = GradientImageFilterType::New();
-  GradientImageFilterPointer    fixedGradientFilter =  GradientImageFilterType::New();
-  InterpPointer interp1 = ScalarInterpolatorType::New();
+  // the patches live in index space, so take the gradient there too
+  typedef ChangeInformationImageFilter< InputImageType > ChangeInformationType;
+  typename ChangeInformationType::Pointer indexSpace = ChangeInformationType::New();
+  typename InputImageType::SpacingType unitSpacing;
+  unitSpacing.Fill( 1 );
+  typename InputImageType::PointType zeroOrigin;
+  zeroOrigin.Fill( 0 );
+  typename InputImageType::DirectionType identity;
+  identity.SetIdentity();
+  indexSpace->SetInput( input );
+  indexSpace->SetOutputSpacing( unitSpacing );
+  indexSpace->SetOutputOrigin( zeroOrigin );
+  indexSpace->SetOutputDirection( identity );
+  indexSpace->ChangeSpacingOn();
+  indexSpace->ChangeOriginOn();
+  indexSpace->ChangeDirectionOn();
+  GradientImageFilterPointer gradientFilter = GradientImageFilterType::New();
+  gradientFilter->SetInput( indexSpace->GetOutput() );
+  gradientFilter->SetSigma( gradientSigma );
+  gradientFilter->Update();
+  typename GradientImageType::Pointer gradientImage = gradientFilter->GetOutput();
 
+  typename NeighborhoodIteratorType::RadiusType radius;
   radius.Fill( this->m_PatchRadius );
-  for( int ii = 0; ii < ImageDimension; ii++)
+  NeighborhoodIteratorType sphere( radius, input, input->GetLargestPossibleRegion() );
+  std::vector< typename NeighborhoodIteratorType::OffsetType > offsets;
+  for( unsigned int ii = 0; ii < this->m_IndicesWithinSphere.size(); ii++ )
     {
-    beginningOfSphereRegion[ii] = this->m_PaddingVoxels + this->m_PatchRadius;
-    sizeOfSphereRegion[ii]      = this->m_PatchRadius * 2 + 1;
+    offsets.push_back( sphere.GetOffset( this->m_IndicesWithinSphere[ ii ] ) );
     }
-  sphereRegion.SetSize( sizeOfSphereRegion );
-  sphereRegion.SetIndex( beginningOfSphereRegion );
 
-  typename ImageType::Pointer eigenvecMaskImage;
-  eigenvecMaskImage = this->GenerateMaskImageFromPatch( );
-  //NeighborhoodIteratorType regionIterator()
-  NeighborhoodIteratorType fixedIterator(radius, this->m_CanonicalFrame, sphereRegion);
-  // compute gradient of canonical frame once, outside the loop
-  fixedGradientFilter->SetInput( this->m_CanonicalFrame );
-  fixedGradientFilter->SetSigma( gradientSigma );
-  fixedGradientFilter->Update();
-  typename GradientImageType::Pointer fixedGradientImage = fixedGradientFilter->GetOutput();
+  const SizeValueType numberOfVoxels = this->m_MaskIndices.size();
+  const unsigned int frameSize = ImageDimension * ImageDimension;
+  this->m_FrameOffsets.resize( numberOfVoxels );
+  this->m_OrientationFrames.resize( numberOfVoxels * frameSize );
+  const RegionType region = gradientImage->GetLargestPossibleRegion();
+  const SizeValueType numberOfChunks = std::max< SizeValueType >( 1,
+    std::min< SizeValueType >( this->GetNumberOfWorkUnits(), numberOfVoxels ) );
+  this->GetMultiThreader()->ParallelizeArray( 0, numberOfChunks,
+    [&]( SizeValueType chunk )
+    {
+    const SizeValueType first = chunk * numberOfVoxels / numberOfChunks;
+    const SizeValueType last = ( chunk + 1 ) * numberOfVoxels / numberOfChunks;
+    vnlMatrixType structureTensor( ImageDimension, ImageDimension );
+    for( SizeValueType i = first; i < last; i++ )
+      {
+      const IndexType center = this->m_MaskIndices[ i ];
+      this->m_FrameOffsets[ i ] = input->ComputeOffset( center );
+      structureTensor.fill( 0 );
+      for( unsigned int ii = 0; ii < offsets.size(); ii++ )
+        {
+        const IndexType index = center + offsets[ ii ];
+        if ( !region.IsInside( index ) )
+          {
+          continue;
+          }
+        const GradientPixelType gradient =
+          gradientImage->GetPixel( index ) * this->m_weights[ ii ];
+        for( unsigned int r = 0; r < ImageDimension; r++ )
+          {
+          for( unsigned int c = 0; c < ImageDimension; c++ )
+            {
+            structureTensor( r, c ) += gradient[ r ] * gradient[ c ];
+            }
+          }
+        }
+      vnl_symmetric_eigensystem< ComputationType > eigensystem( structureTensor );
+      float * frame = &this->m_OrientationFrames[ i * frameSize ];
+      for( unsigned int r = 0; r < ImageDimension; r++ )
+        {
+        for( unsigned int c = 0; c < ImageDimension; c++ )
+          {
+          frame[ r * ImageDimension + c ] = eigensystem.V( r, c );
+          }
+        }
+      }
+    }, ITK_NULLPTR );
+
+  this->m_FrameCacheInput = input;
+  this->m_FrameCacheInputTime = input->GetMTime();
+  this->m_FrameCacheMask = mask;
+  this->m_FrameCacheMaskTime = mask->GetMTime();
+  this->m_FrameCacheRadius = this->m_PatchRadius;
+  this->m_FrameCacheSigma = gradientSigma;
+}
 
-  if ( this->m_Verbose )
-    std::cout << "vectorizedSamplePatchMatrix is " << this->m_vectorizedSamplePatchMatrix.rows() <<
-      "x" << this->m_vectorizedSamplePatchMatrix.columns() << std::endl;
-  for( long int ii = 0; ii < this->m_vectorizedSamplePatchMatrix.rows(); ii++)
-    {
-    vnl_vector< ComputationType > vectorizedPatch =
-        this->m_vectorizedSamplePatchMatrix.get_row(ii);
-    typename ImageType::Pointer movingImage = this->ConvertVectorToSpatialImage(
-        vectorizedPatch, eigenvecMaskImage );
-    NeighborhoodIteratorType movingIterator(radius, movingImage, sphereRegion);
-    movingGradientFilter->SetInput(movingImage);
-    movingGradientFilter->SetSigma(gradientSigma);
-    movingGradientFilter->Update();
-    interp1->SetInputImage(movingImage);
-    typename GradientImageType::Pointer movingGradientImage = movingGradientFilter->GetOutput();
-    vnl_vector< ComputationType > rotatedPatchAsVector =
-        this->ReorientPatchToReferenceFrame(
-            fixedIterator, movingIterator, eigenvecMaskImage,
-            fixedGradientImage,
-            movingGradientImage,
-            interp1 );
-    this->m_vectorizedSamplePatchMatrix.set_row( ii, rotatedPatchAsVector );
+template <typename TInputImage, typename TOutputImage, class TComputation>
+bool RIPMMARCImageFilter<TInputImage, TOutputImage, TComputation>
+::GetOrientationFrame( const IndexType & index, vnlMatrixType & frame ) const
+{
+  const OffsetValueType offset = this->GetInput()->ComputeOffset( index );
+  typename std::vector< OffsetValueType >::const_iterator it = std::lower_bound(
+    this->m_FrameOffsets.begin(), this->m_FrameOffsets.end(), offset );
+  if ( it == this->m_FrameOffsets.end() || *it != offset )
+    {
+    return false;
     }
+  const unsigned int frameSize = ImageDimension * ImageDimension;
+  const float * values =
+    &this->m_OrientationFrames[ ( it - this->m_FrameOffsets.begin() ) * frameSize ];
+  frame.set_size( ImageDimension, ImageDimension );
+  for( unsigned int r = 0; r < ImageDimension; r++ )
+    {
+    for( unsigned int c = 0; c < ImageDimension; c++ )
+      {
+      frame( r, c ) = values[ r * ImageDimension + c ];
+      }
+    }
+  return true;
+}
 
+template <typename TInputImage, typename TOutputImage, class TComputation>
+vnl_vector< TComputation > RIPMMARCImageFilter<TInputImage, TOutputImage, TComputation>
+::ReorientPatchWithFrames(
+  const VectorType & patch,
+  const VectorType & centeredCanonicalPatch,
+  const vnlMatrixType & fixedFrame,
+  const vnlMatrixType & movingFrame,
+  const std::vector< PointType > & points,
+  const PointType & center,
+  InterpPointer Interpolator )
+{
+  // the rotation part of ReorientPatchToReferenceFrame, with both frames
+  // given; the eigenvectors are in ascending order of eigenvalue
+  vnl_diag_matrix< ComputationType > mudiag( ImageDimension, 1.e-4 );
+  vnl_matrix< ComputationType > B = outer_product(
+    fixedFrame.get_column( ImageDimension - 1 ), movingFrame.get_column( ImageDimension - 1 ) );
+  if( ImageDimension == 3 )
+    {
+    B += outer_product( fixedFrame.get_column( ImageDimension - 2 ),
+      movingFrame.get_column( ImageDimension - 2 ) );
+    }
+  vnl_svd< ComputationType > WahbaSVD( B + mudiag );
+  vnl_matrix< ComputationType > Q_solution = WahbaSVD.V() * WahbaSVD.U().transpose();
+  VectorType rotatedPatch( patch );
+  vnl_vector< ComputationType > pointVector( ImageDimension );
+  for( unsigned int pass = 0; pass < 2; pass++ )
+    {
+    for( unsigned int ii = 0; ii < points.size(); ii++ )
+      {
+      for( unsigned int dd = 0; dd < ImageDimension; dd++ )
+        {
+        pointVector[ dd ] = points[ ii ][ dd ] - center[ dd ];
+        }
+      pointVector = Q_solution * pointVector;
+      PointType rotatedPoint;
+      for( unsigned int dd = 0; dd < ImageDimension; dd++ )
+        {
+        rotatedPoint[ dd ] = pointVector[ dd ] + center[ dd ];
+        }
+      if( Interpolator->IsInsideBuffer( rotatedPoint ) )
+        {
+        rotatedPatch[ ii ] = Interpolator->Evaluate( rotatedPoint );
+        }
+      }
+    // the eigenvectors have no sign, so undo a flip that leaves the patch
+    // anticorrelated with the canonical one
+    if( pass > 0 || inner_product( centeredCanonicalPatch,
+          rotatedPatch - rotatedPatch.mean() ) >= 0 )
+      {
+      break;
+      }
+    vnl_matrix< ComputationType > rotationMat( ImageDimension, ImageDimension, 0 );
+    rotationMat.set_identity();
+    if( ImageDimension == 2 )
+      {
+      rotationMat( 0, 0 ) = -1;
+      rotationMat( 1, 1 ) = -1;
+      }
+    else if( ImageDimension == 3 )
+      {
+      rotationMat( 1, 1 ) = -1;
+      rotationMat( 2, 2 ) = -1;
+      }
+    Q_solution = Q_solution * rotationMat;
+    }
+  return rotatedPatch;
 }
 
 template <typename TInputImage, typename TOutputImage, class TComputation>
 void RIPMMARCImageFilter<TInputImage, TOutputImage, TComputation>
-::ReorientAllPatches()
+::ReorientPatches( vnlMatrixType & patches, bool patchesInColumns,
+  SizeValueType firstVoxel )
 {
   typedef InputImageType ImageType;
-  ComputationType gradientSigma = 1.0;
+  RealType gradientSigma =                          1.0;
   typename NeighborhoodIteratorType::RadiusType radius;
 
-  GradientImageFilterPointer    movingGradientFilter = GradientImageFilterType::New();
   GradientImageFilterPointer    fixedGradientFilter =  GradientImageFilterType::New();
-  InterpPointer interp1 = ScalarInterpolatorType::New();
 
   radius.Fill( this->m_PatchRadius );
   for( int ii = 0; ii < ImageDimension; ii++)
@@ -657,36 +834,205 @@ void RIPMMARCImageFilter<TInputImage, TOutputImage, TComputation>
   sphereRegion.SetSize( sizeOfSphereRegion );
   sphereRegion.SetIndex( beginningOfSphereRegion );
 
-  typename ImageType::Pointer eigenvecMaskImage;
-  eigenvecMaskImage = this->GenerateMaskImageFromPatch( );
-  NeighborhoodIteratorType fixedIterator( radius, this->m_CanonicalFrame, sphereRegion);
   // compute gradient of canonical frame once, outside the loop
   fixedGradientFilter->SetInput( this->m_CanonicalFrame );
   fixedGradientFilter->SetSigma( gradientSigma );
   fixedGradientFilter->Update();
   typename GradientImageType::Pointer fixedGradientImage = fixedGradientFilter->GetOutput();
 
-  for( long int ii = 0; ii < this->m_PatchesForAllPointsWithinMask.columns(); ii++)
+  // with cached frames every patch shares the sphere points, the canonical
+  // frame and the canonical patch, so work them out once
+  vnlMatrixType fixedFrame;
+  VectorType centeredCanonicalPatch;
+  std::vector< PointType > points;
+  PointType center;
+  center.Fill( 0 );
+  if ( this->m_CacheOrientationFrames )
+    {
+    this->ComputeOrientationFrames();
+    NeighborhoodIteratorType fixedIterator( radius, this->m_CanonicalFrame, sphereRegion );
+    const unsigned int numberOfIndicesWithinSphere = this->m_IndicesWithinSphere.size();
+    vnlMatrixType structureTensor( ImageDimension, ImageDimension, 0 );
+    centeredCanonicalPatch.set_size( numberOfIndicesWithinSphere );
+    for( unsigned int ii = 0; ii < numberOfIndicesWithinSphere; ii++ )
+      {
+      const IndexType index = fixedIterator.GetIndex( this->m_IndicesWithinSphere[ ii ] );
+      const GradientPixelType gradient =
+        fixedGradientImage->GetPixel( index ) * this->m_weights[ ii ];
+      for( unsigned int r = 0; r < ImageDimension; r++ )
+        {
+        for( unsigned int c = 0; c < ImageDimension; c++ )
+          {
+          structureTensor( r, c ) += gradient[ r ] * gradient[ c ];
+          }
+        }
+      PointType point;
+      this->m_CanonicalFrame->TransformIndexToPhysicalPoint( index, point );
+      for( unsigned int dd = 0; dd < ImageDimension; dd++ )
+        {
+        center[ dd ] += point[ dd ] / numberOfIndicesWithinSphere;
+        }
+      points.push_back( point );
+      centeredCanonicalPatch[ ii ] = fixedIterator.GetPixel( this->m_IndicesWithinSphere[ ii ] );
+      }
+    centeredCanonicalPatch -= centeredCanonicalPatch.mean();
+    vnl_symmetric_eigensystem< ComputationType > eigensystem( structureTensor );
+    fixedFrame = eigensystem.V;
+    }
+
+  const SizeValueType numberOfPatches =
+    patchesInColumns ? patches.columns() : patches.rows();
+  const SizeValueType numberOfChunks = std::max< SizeValueType >( 1,
+    std::min< SizeValueType >( this->GetNumberOfWorkUnits(), numberOfPatches ) );
+  // each work unit owns its patch mask, gradient filter, interpolator and
+  // iterators; the canonical frame and its gradient are only read
+  this->GetMultiThreader()->ParallelizeArray( 0, numberOfChunks,
+    [&]( SizeValueType chunk )
     {
-    vnl_vector< ComputationType > vectorizedPatch =
-        this->m_PatchesForAllPointsWithinMask.get_column( ii );
-    typename ImageType::Pointer movingImage =
-      this->ConvertVectorToSpatialImage( vectorizedPatch, eigenvecMaskImage);
-    NeighborhoodIteratorType movingIterator( radius, movingImage, sphereRegion );
-    movingGradientFilter->SetInput( movingImage );
+    const SizeValueType first = chunk * numberOfPatches / numberOfChunks;
+    const SizeValueType last = ( chunk + 1 ) * numberOfPatches / numberOfChunks;
+    typename ImageType::Pointer eigenvecMaskImage = this->GenerateMaskImageFromPatch( );
+    NeighborhoodIteratorType fixedIterator( radius, this->m_CanonicalFrame, sphereRegion );
+    GradientImageFilterPointer movingGradientFilter = GradientImageFilterType::New();
     movingGradientFilter->SetSigma( gradientSigma );
-    movingGradientFilter->Update();
-    interp1->SetInputImage( movingImage );
-    typename GradientImageType::Pointer movingGradientImage = movingGradientFilter->GetOutput();
-    vnl_vector< ComputationType > rotatedPatchAsVector =
-        this->ReorientPatchToReferenceFrame(
-            fixedIterator, movingIterator, eigenvecMaskImage,
-            fixedGradientImage,
-            movingGradientImage,
-            interp1 );
-    this->m_PatchesForAllPointsWithinMask.set_column( ii, rotatedPatchAsVector );
-  }
+    movingGradientFilter->SetNumberOfWorkUnits( 1 );
+    InterpPointer interp1 = ScalarInterpolatorType::New();
+    vnlMatrixType movingFrame;
+    for( SizeValueType ii = first; ii < last; ii++ )
+      {
+      VectorType vectorizedPatch =
+        patchesInColumns ? patches.get_column( ii ) : patches.get_row( ii );
+      typename ImageType::Pointer movingImage =
+        this->ConvertVectorToSpatialImage( vectorizedPatch, eigenvecMaskImage );
+      interp1->SetInputImage( movingImage );
+      VectorType rotatedPatchAsVector;
+      if ( this->m_CacheOrientationFrames )
+        {
+        // the columns are the mask voxels from firstVoxel on, the rows the
+        // sample seeds
+        IndexType patchIndex;
+        for( unsigned int dd = 0; dd < ImageDimension; dd++ )
+          {
+          patchIndex[ dd ] = patchesInColumns ?
+            this->m_MaskIndices[ firstVoxel + ii ][ dd ] : this->m_patchSeedPoints( ii, dd );
+          }
+        if ( !this->GetOrientationFrame( patchIndex, movingFrame ) )
+          {
+          continue;
+          }
+        rotatedPatchAsVector = this->ReorientPatchWithFrames( vectorizedPatch,
+          centeredCanonicalPatch, fixedFrame, movingFrame, points, center, interp1 );
+        }
+      else
+        {
+        NeighborhoodIteratorType movingIterator( radius, movingImage, sphereRegion );
+        movingGradientFilter->SetInput( movingImage );
+        movingGradientFilter->Update();
+        typename GradientImageType::Pointer movingGradientImage = movingGradientFilter->GetOutput();
+        rotatedPatchAsVector =
+            this->ReorientPatchToReferenceFrame(
+                fixedIterator, movingIterator, eigenvecMaskImage,
+                fixedGradientImage,
+                movingGradientImage,
+                interp1 );
+        }
+      if ( patchesInColumns )
+        {
+        patches.set_column( ii, rotatedPatchAsVector );
+        }
+      else
+        {
+        patches.set_row( ii, rotatedPatchAsVector );
+        }
+      }
+    }, ITK_NULLPTR );
+}
 
+template <typename TInputImage, typename TOutputImage, class TComputation>
+void RIPMMARCImageFilter<TInputImage, TOutputImage, TComputation>
+::ReorientSamplePatches()
+{
+  if ( this->m_Verbose )
+    std::cout << "vectorizedSamplePatchMatrix is " << this->m_vectorizedSamplePatchMatrix.rows() <<
+      "x" << this->m_vectorizedSamplePatchMatrix.columns() << std::endl;
+  this->ReorientPatches( this->m_vectorizedSamplePatchMatrix, false );
+}
+
+template <typename TInputImage, typename TOutputImage, class TComputation>
+void RIPMMARCImageFilter<TInputImage, TOutputImage, TComputation>
+::ReorientAllPatches()
+{
+  this->ReorientPatches( this->m_PatchesForAllPointsWithinMask, true );
+}
+
+template <typename TInputImage, typename TOutputImage, class TComputation>
+void RIPMMARCImageFilter<TInputImage, TOutputImage, TComputation>
+::ProjectPatches(
+  const vnlMatrixType & patches,
+  SizeValueType firstVoxel,
+  const vnlMatrixType & pseudoInverse,
+  VectorType & percentError )
+{
+  // Tiling the voxels bounds the temporaries to a block.  Both products
+  // are accumulated a row at a time, so every inner loop runs over the
+  // contiguous voxels of a row and vectorizes.
+  const unsigned int numberOfRows = patches.rows();
+  const unsigned int numberOfEigenvectors = pseudoInverse.rows();
+  const vnlMatrixType & eigenvectors = this->GetEigenPatchBasis();
+  const SizeValueType numberOfVoxels = patches.columns();
+  const SizeValueType blockSize = 4096;
+  const SizeValueType numberOfBlocks = ( numberOfVoxels + blockSize - 1 ) / blockSize;
+  this->GetMultiThreader()->ParallelizeArray( 0, numberOfBlocks,
+    [&]( SizeValueType block )
+    {
+    const SizeValueType first = block * blockSize;
+    const unsigned int width = std::min( blockSize, numberOfVoxels - first );
+    // coefficients = pseudoInverse * patches
+    std::vector< ComputationType > coefficients( numberOfEigenvectors * width, 0 );
+    for( unsigned int r = 0; r < numberOfEigenvectors; ++r )
+      {
+      ComputationType * const c = &coefficients[ r * width ];
+      for( unsigned int j = 0; j < numberOfRows; ++j )
+        {
+        const ComputationType weight = pseudoInverse( r, j );
+        const ComputationType * const p = patches[ j ] + first;
+        for( unsigned int i = 0; i < width; ++i )
+          {
+          c[ i ] += weight * p[ i ];
+          }
+        }
+      std::copy( c, c + width, this->m_EigenvectorCoefficients[ r ] + firstVoxel + first );
+      }
+    // reconstruction error in the same pass
+    std::vector< ComputationType > reconstruction( width );
+    std::vector< ComputationType > errorNorm( width, 0 );
+    std::vector< ComputationType > patchNorm( width, 0 );
+    for( unsigned int j = 0; j < numberOfRows; ++j )
+      {
+      std::fill( reconstruction.begin(), reconstruction.end(), 0 );
+      for( unsigned int r = 0; r < numberOfEigenvectors; ++r )
+        {
+        const ComputationType weight = eigenvectors( j, r );
+        const ComputationType * const c = &coefficients[ r * width ];
+        for( unsigned int i = 0; i < width; ++i )
+          {
+          reconstruction[ i ] += weight * c[ i ];
+          }
+        }
+      const ComputationType * const p = patches[ j ] + first;
+      for( unsigned int i = 0; i < width; ++i )
+        {
+        const ComputationType difference = reconstruction[ i ] - p[ i ];
+        errorNorm[ i ] += difference * difference;
+        patchNorm[ i ] += p[ i ] * p[ i ];
+        }
+      }
+    for( unsigned int i = 0; i < width; ++i )
+      {
+      percentError( firstVoxel + first + i ) = std::sqrt( errorNorm[ i ] ) /
+        ( std::sqrt( patchNorm[ i ] ) + 1e-10 );
+      }
+    }, ITK_NULLPTR );
 }
 
 template <typename TInputImage, typename TOutputImage, class TComputation>
@@ -702,38 +1048,164 @@ void RIPMMARCImageFilter<TInputImage, TOutputImage, TComputation>
   // output, eigenvectorCoefficients, is then number of eigenvectors
   // x number of patches ('x' solutions for all patches).
   if ( this->m_Verbose ) std::cout << "Computing regression." << std::endl;
-  this->m_EigenvectorCoefficients.set_size( this->m_SignificantPatchEigenvectors.columns(),
+  this->m_EigenvectorCoefficients.set_size( this->GetEigenPatchBasis().columns(),
     this->m_numberOfVoxelsWithinMask );
-  this->m_EigenvectorCoefficients.fill( 0 );
-  vnl_svd< ComputationType > RegressionSVD( this->m_SignificantPatchEigenvectors );
-  //  EigenvectorCoefficients =  RegressionSVD.solve(PatchesForAllPointsWithinMask);
-  //  not feasible for large matrices
-  for( long unsigned int i = 0; i < this->m_numberOfVoxelsWithinMask; ++i )
-    {
-    VectorType PatchOfInterest =
-        this->m_PatchesForAllPointsWithinMask.get_column( i );
-    VectorType x( this->m_SignificantPatchEigenvectors.columns() );
-    x.fill( 0 );
-    x = RegressionSVD.solve( PatchOfInterest );
-    this->m_EigenvectorCoefficients.set_column( i, x );
-    }
-  vnl_matrix< ComputationType > reconstructedPatches =
-      this->m_SignificantPatchEigenvectors * this->m_EigenvectorCoefficients;
-  vnl_matrix< ComputationType > error =
-      reconstructedPatches - this->m_PatchesForAllPointsWithinMask;
-  vnl_vector< ComputationType > percentError(error.columns() );
-  for( int i = 0; i < error.columns(); ++i)
-    {
-    percentError(i) = error.get_column(i).two_norm() /
-        (this->m_PatchesForAllPointsWithinMask.get_column(i).two_norm() + 1e-10);
-    }
-  if( this->m_Verbose )
+  // the least squares solution for every patch is one pseudo-inverse times
+  // the patch matrix; for the orthonormal eigenpatches that is just the
+  // transpose.
+  vnl_svd< ComputationType > RegressionSVD( this->GetEigenPatchBasis() );
+  const vnlMatrixType pseudoInverse = RegressionSVD.pinverse();
+  VectorType percentError( this->m_numberOfVoxelsWithinMask, 0 );
+  this->ProjectPatches( this->m_PatchesForAllPointsWithinMask, 0,
+    pseudoInverse, percentError );
+  if( this->m_Verbose && this->m_numberOfVoxelsWithinMask > 0 )
+    {
+    std::cout << "Average percent error is " << percentError.mean() * 100 << "%, with max of " <<
+        percentError.max_value() * 100 << "%." <<  std::endl;
+    }
+}
+
+template <typename TInputImage, typename TOutputImage, class TComputation>
+void RIPMMARCImageFilter<TInputImage, TOutputImage, TComputation>
+::StreamAllPatches()
+{
+  // the mask is walked in chunks that are extracted, reoriented and
+  // projected in turn, so only the coefficients stay resident
+  const InputImagePointer finalCanonicalFrame = this->m_CanonicalFrame;
+  this->m_PatchesForAllPointsWithinMask.clear();
+  const SizeValueType numberOfVoxels = this->m_numberOfVoxelsWithinMask;
+  vnlMatrixType pseudoInverse;
+  VectorType percentError;
+  if ( this->m_ProjectOnEigenPatches )
+    {
+    this->m_EigenvectorCoefficients.set_size(
+      this->GetEigenPatchBasis().columns(), numberOfVoxels );
+    vnl_svd< ComputationType > RegressionSVD( this->GetEigenPatchBasis() );
+    pseudoInverse = RegressionSVD.pinverse();
+    percentError.set_size( numberOfVoxels );
+    percentError.fill( 0 );
+    }
+  if ( this->m_Verbose )
+    std::cout << "Streaming " << numberOfVoxels << " patches in chunks of " <<
+      this->m_StreamingChunkSize << "." << std::endl;
+  for( SizeValueType first = 0; first < numberOfVoxels; first += this->m_StreamingChunkSize )
+    {
+    const SizeValueType width = std::min( this->m_StreamingChunkSize, numberOfVoxels - first );
+    vnlMatrixType patches( this->m_IndicesWithinSphere.size(), width );
+    this->m_PhaseTimes.Start( "extract" );
+    this->ExtractPatches( first, patches );
+    this->m_PhaseTimes.Stop( "extract" );
+    if ( this->m_RotationInvariant )
+      {
+      // the full patches go to the frame the samples were reoriented to,
+      // as in the unstreamed pipeline
+      this->m_PhaseTimes.Start( "reorient" );
+      this->m_CanonicalFrame = this->m_ReorientationFrame;
+      this->ReorientPatches( patches, true, first );
+      this->m_CanonicalFrame = finalCanonicalFrame;
+      this->m_PhaseTimes.Stop( "reorient" );
+      }
+    if ( this->m_ProjectOnEigenPatches )
+      {
+      this->m_PhaseTimes.Start( "project" );
+      this->ProjectPatches( patches, first, pseudoInverse, percentError );
+      this->m_PhaseTimes.Stop( "project" );
+      }
+    }
+  if( this->m_Verbose && this->m_ProjectOnEigenPatches && numberOfVoxels > 0 )
     {
     std::cout << "Average percent error is " << percentError.mean() * 100 << "%, with max of " <<
         percentError.max_value() * 100 << "%." <<  std::endl;
     }
 }
 
+template <typename TInputImage, typename TOutputImage, class TComputation>
+void RIPMMARCImageFilter<TInputImage, TOutputImage, TComputation>
+::WriteEigenPatchBasis( const std::string & fileName ) const
+{
+  const vnlMatrixType & basis = this->GetEigenPatchBasis();
+  if ( basis.empty() || basis.rows() != this->m_IndicesWithinSphere.size() )
+    {
+    itkExceptionMacro( "No eigenpatch basis to write; update the filter first." );
+    }
+  try
+    {
+    eigenPatchBasisWrite( fileName, ImageDimension, this->m_PatchRadius,
+      this->m_MeanCenterPatches, this->m_RotationInvariant,
+      this->m_IndicesWithinSphere, basis );
+    }
+  catch( const std::exception & exc )
+    {
+    itkExceptionMacro( << exc.what() );
+    }
+}
+
+template <typename TInputImage, typename TOutputImage, class TComputation>
+void RIPMMARCImageFilter<TInputImage, TOutputImage, TComputation>
+::ReadEigenPatchBasis( const std::string & fileName )
+{
+  std::shared_ptr< eigenPatchBasisMap > basisMap;
+  try
+    {
+    basisMap.reset( new eigenPatchBasisMap( fileName ) );
+    }
+  catch( const std::exception & exc )
+    {
+    itkExceptionMacro( << exc.what() );
+    }
+  const eigenPatchBasisHeader & header = basisMap->Header();
+  if ( header.dimension != ImageDimension )
+    {
+    itkExceptionMacro( "The basis in " << fileName << " is for " <<
+      header.dimension << "D patches, not " << ImageDimension << "D." );
+    }
+  this->m_PatchRadius = header.radius;
+  this->m_MeanCenterPatches = basisMap->MeanCenter();
+  this->m_RotationInvariant = basisMap->RotationInvariant();
+  this->m_LearnPatchBasis = false;
+  const ComputationType * basis = basisMap->template Basis< ComputationType >();
+  if ( basis )
+    {
+    // vnl_matrix_ref never frees the mapped values
+    this->m_MappedBasis.reset( new vnl_matrix_ref< ComputationType >(
+      header.numberOfIndices, header.numberOfEigenPatches,
+      const_cast< ComputationType * >( basis ) ) );
+    this->m_SignificantPatchEigenvectors.clear();
+    }
+  else
+    {
+    // written at the other precision, so it has to be converted
+    this->m_MappedBasis.reset();
+    this->m_SignificantPatchEigenvectors =
+      basisMap->template BasisCopy< ComputationType >();
+    }
+  this->m_BasisMap = basisMap;
+  this->Modified();
+}
+
+template <typename TInputImage, typename TOutputImage, class TComputation>
+void RIPMMARCImageFilter<TInputImage, TOutputImage, TComputation>
+::VerifyEigenPatchBasis() const
+{
+  const vnlMatrixType & basis = this->GetEigenPatchBasis();
+  if ( basis.rows() != this->m_IndicesWithinSphere.size() )
+    {
+    itkExceptionMacro( "The eigenpatch basis has " << basis.rows() <<
+      " rows but the patches have " << this->m_IndicesWithinSphere.size() << " voxels." );
+    }
+  if ( this->m_BasisMap )
+    {
+    const uint32_t * indices = this->m_BasisMap->Indices();
+    for( unsigned int i = 0; i < this->m_IndicesWithinSphere.size(); i++ )
+      {
+      if ( indices[ i ] != this->m_IndicesWithinSphere[ i ] )
+        {
+        itkExceptionMacro( "The sphere index table of the eigenpatch basis "
+          "does not match the patches of this filter." );
+        }
+      }
+    }
+}
 
 template <typename TInputImage, typename TOutputImage, class TComputation>
 void RIPMMARCImageFilter<TInputImage, TOutputImage, TComputation>
@@ -743,37 +1215,80 @@ void RIPMMARCImageFilter<TInputImage, TOutputImage, TComputation>
 // patches if we already have a basis?
   unsigned int canonicalEvecIndex = 1;
   if ( this->m_MeanCenterPatches ) canonicalEvecIndex = 0;
+  this->m_PhaseTimes.Clear();
+  this->m_PhaseTimes.Start( "sample" );
   this->GetSamplePatchLocations( ); // identify points from random mask
   this->ExtractSamplePatches( );     // convert sample points to the matrix
+  this->m_PhaseTimes.Stop( "sample" );
 	if ( this->m_LearnPatchBasis )  // determines if we are learning or not
 	  {
+    this->m_PhaseTimes.Start( "learn" );
   	this->LearnEigenPatches( );  // learn the patches
     // the SECOND eigenvector is canonical--1st is constant
     this->m_CanonicalFrame = this->GetCanonicalFrameK( canonicalEvecIndex );
+    this->m_PhaseTimes.Stop( "learn" );
 	  }
   else
     {
     // use existing significantPatchEigenvectors as reference
     // check the eigenpatches have the correct dimensionality then
     // just apply the learning, given the eigenpatch
-    // FIXME - need to implement these checks
+    this->VerifyEigenPatchBasis();
+    if ( this->m_RotationInvariant && !this->m_CanonicalFrame )
+      {
+      this->m_CanonicalFrame = this->GetCanonicalFrameK( canonicalEvecIndex );
+      }
 	  }
+  if ( this->m_StreamingChunkSize > 0 )
+    {
+    // everything but the full patch matrix: the reoriented samples give
+    // the final basis before any full patch is extracted
+    this->CollectMaskIndices();
+    this->m_ReorientationFrame = this->m_CanonicalFrame;
+    if ( this->m_RotationInvariant )
+      {
+      this->m_PhaseTimes.Start( "reorient" );
+      this->ReorientSamplePatches();
+      this->m_PhaseTimes.Stop( "reorient" );
+      if ( this->m_LearnPatchBasis )
+        {
+        this->m_PhaseTimes.Start( "learn" );
+        this->LearnEigenPatches(); // learn the patches after reorientation
+        this->m_CanonicalFrame = this->GetCanonicalFrameK( canonicalEvecIndex );
+        this->m_PhaseTimes.Stop( "learn" );
+        }
+      }
+    this->StreamAllPatches();
+    this->m_ReorientationFrame = ITK_NULLPTR;
+    }
+  else
+    {
+  this->m_PhaseTimes.Start( "extract" );
 	this->ExtractAllPatches( );
+  this->m_PhaseTimes.Stop( "extract" );
 	// because all patches are reoriented to the first (non-rotationally invariant)
 	// eigenpatch, we must learn the eigenpatches even if we will in the end use
 	// rotationally invariant features.
 	if ( this->m_RotationInvariant )
 	  {
+    this->m_PhaseTimes.Start( "reorient" );
     this->ReorientSamplePatches();
 		this->ReorientAllPatches();
+    this->m_PhaseTimes.Stop( "reorient" );
 		if ( this->m_LearnPatchBasis )
       {
+      this->m_PhaseTimes.Start( "learn" );
 			this->LearnEigenPatches(); // learn the patches after reorientation
       // the SECOND eigenvector is canonical--1st is constant if we do not mean center
       this->m_CanonicalFrame = this->GetCanonicalFrameK( canonicalEvecIndex );
+      this->m_PhaseTimes.Stop( "learn" );
       }
 	  }
+  this->m_PhaseTimes.Start( "project" );
   this->ProjectOnEigenPatches( ); // in practice, we might prefer this in R
+  this->m_PhaseTimes.Stop( "project" );
+    }
+  if ( this->m_Verbose ) this->m_PhaseTimes.Report( std::cout );
   this->SetNthOutput( 0, this->GetCanonicalFrame() );
 }
 
@@ -808,6 +1323,12 @@ RIPMMARCImageFilter<TInputImage, TOutputImage, TComputation>
 
   os << indent << "ProjectOnEigenPatches = " << this->m_ProjectOnEigenPatches << std::endl;
 
+  os << indent << "RandomizedSVD = " << this->m_RandomizedSVD << std::endl;
+
+  os << indent << "CacheOrientationFrames = " << this->m_CacheOrientationFrames << std::endl;
+
+  os << indent << "StreamingChunkSize = " << this->m_StreamingChunkSize << std::endl;
+
 }
 
 
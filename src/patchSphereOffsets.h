@@ -0,0 +1,156 @@
+#ifndef patchSphereOffsets_h
+#define patchSphereOffsets_h
+
+#include <cmath>
+#include <vector>
+#include "itkIntTypes.h"
+#include "itkOffset.h"
+
+/** The voxels of a spherical patch.  For each voxel within radius of the
+ * center (in voxel units) the table holds its position in the enclosing
+ * hypercube neighborhood, in NeighborhoodIterator order, its offset from
+ * the center and the matching offset into an image buffer with the given
+ * offset table.  It only depends on the dimension, the radius and the
+ * buffer layout, so it is built once and reused for every patch. */
+template< unsigned int VDimension >
+struct patchSphereOffsetTable
+{
+  typedef itk::Offset< VDimension > OffsetType;
+
+  patchSphereOffsetTable() : radius( -1 ), extent( 0 ), neighborhoodSize( 0 )
+    {
+    for ( unsigned int d = 0; d <= VDimension; d++ )
+      {
+      bufferOffsets[d] = 0;
+      }
+    }
+
+  /** Is the table built for this radius and buffer offset table? */
+  bool Matches( double r, const itk::OffsetValueType * offsetTable ) const
+    {
+    if ( r != radius )
+      {
+      return false;
+      }
+    for ( unsigned int d = 0; d <= VDimension; d++ )
+      {
+      if ( offsetTable[d] != bufferOffsets[d] )
+        {
+        return false;
+        }
+      }
+    return true;
+    }
+
+  double                              radius;
+  itk::SizeValueType                  extent; // radius of the hypercube
+  itk::SizeValueType                  neighborhoodSize;
+  itk::OffsetValueType                bufferOffsets[VDimension + 1];
+  std::vector< unsigned int >         neighborhoodIndices;
+  std::vector< OffsetType >           offsets;
+  std::vector< itk::OffsetValueType > linearOffsets;
+};
+
+/** Build table for radius and a buffer whose offset table (as returned by
+ * Image::GetOffsetTable) is offsetTable. */
+template< unsigned int VDimension >
+void patchSphereOffsetTableCompute( double radius,
+  const itk::OffsetValueType * offsetTable,
+  patchSphereOffsetTable< VDimension > & table )
+{
+  table.radius = radius;
+  table.extent = static_cast< itk::SizeValueType >( radius );
+  for ( unsigned int d = 0; d <= VDimension; d++ )
+    {
+    table.bufferOffsets[d] = offsetTable[d];
+    }
+  const itk::SizeValueType width = 2 * table.extent + 1;
+  table.neighborhoodSize = 1;
+  for ( unsigned int d = 0; d < VDimension; d++ )
+    {
+    table.neighborhoodSize *= width;
+    }
+  table.neighborhoodIndices.clear();
+  table.offsets.clear();
+  table.linearOffsets.clear();
+  for ( itk::SizeValueType ii = 0; ii < table.neighborhoodSize; ii++ )
+    {
+    typename patchSphereOffsetTable< VDimension >::OffsetType offset;
+    itk::SizeValueType position = ii;
+    double distance = 0;
+    itk::OffsetValueType linearOffset = 0;
+    for ( unsigned int d = 0; d < VDimension; d++ )
+      {
+      offset[d] = static_cast< itk::OffsetValueType >( position % width ) -
+        static_cast< itk::OffsetValueType >( table.extent );
+      position /= width;
+      distance += offset[d] * offset[d];
+      linearOffset += offset[d] * offsetTable[d];
+      }
+    if ( std::sqrt( distance ) <= radius )
+      {
+      table.neighborhoodIndices.push_back( ii );
+      table.offsets.push_back( offset );
+      table.linearOffsets.push_back( linearOffset );
+      }
+    }
+}
+
+/** Copy the patch of image centered at index into values.  A patch that
+ * lies within the buffer is read straight from it through the linear
+ * offsets; only patches in the boundary band check their voxels, which are
+ * clamped to the buffer like the default NeighborhoodIterator boundary
+ * condition. */
+template< class TImage, class T >
+void patchSphereGather( const TImage * image,
+  const patchSphereOffsetTable< TImage::ImageDimension > & table,
+  const typename TImage::IndexType & index,
+  T * values )
+{
+  const unsigned int Dimension = TImage::ImageDimension;
+  const typename TImage::RegionType & buffered = image->GetBufferedRegion();
+  const typename TImage::IndexType & start = buffered.GetIndex();
+  const typename TImage::SizeType & size = buffered.GetSize();
+  const itk::OffsetValueType extent = table.extent;
+  const unsigned int numberOfVoxels = table.linearOffsets.size();
+  bool interior = true;
+  for ( unsigned int d = 0; d < Dimension; d++ )
+    {
+    if ( index[d] - extent < start[d] ||
+         index[d] + extent >= start[d] + static_cast< itk::OffsetValueType >( size[d] ) )
+      {
+      interior = false;
+      }
+    }
+  if ( interior )
+    {
+    const typename TImage::PixelType * center =
+      image->GetBufferPointer() + image->ComputeOffset( index );
+    const itk::OffsetValueType * offsets = &table.linearOffsets[0];
+    for ( unsigned int j = 0; j < numberOfVoxels; j++ )
+      {
+      values[j] = center[ offsets[j] ];
+      }
+    return;
+    }
+  for ( unsigned int j = 0; j < numberOfVoxels; j++ )
+    {
+    typename TImage::IndexType neighbor = index + table.offsets[j];
+    for ( unsigned int d = 0; d < Dimension; d++ )
+      {
+      const itk::OffsetValueType last =
+        start[d] + static_cast< itk::OffsetValueType >( size[d] ) - 1;
+      if ( neighbor[d] < start[d] )
+        {
+        neighbor[d] = start[d];
+        }
+      else if ( neighbor[d] > last )
+        {
+        neighbor[d] = last;
+        }
+      }
+    values[j] = image->GetPixel( neighbor );
+    }
+}
+
+#endif
@@ -0,0 +1,143 @@
+#ifndef randomizedSVD_h
+#define randomizedSVD_h
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include "vnl/vnl_matrix.h"
+#include "vnl/vnl_vector.h"
+#include <vnl/algo/vnl_svd.h>
+
+/** Orthonormalize the columns of Y in place by modified Gram-Schmidt; a
+ * column that vanishes against the previous ones is set to zero. */
+template< class T >
+void randomizedSVDOrthonormalizeColumns( vnl_matrix< T > & Y )
+{
+  const unsigned int rows = Y.rows();
+  for ( unsigned int j = 0; j < Y.columns(); j++ )
+    {
+    for ( unsigned int i = 0; i < j; i++ )
+      {
+      double projection = 0;
+      for ( unsigned int r = 0; r < rows; r++ )
+        {
+        projection += Y( r, i ) * Y( r, j );
+        }
+      for ( unsigned int r = 0; r < rows; r++ )
+        {
+        Y( r, j ) -= projection * Y( r, i );
+        }
+      }
+    double norm = 0;
+    for ( unsigned int r = 0; r < rows; r++ )
+      {
+      norm += Y( r, j ) * Y( r, j );
+      }
+    norm = std::sqrt( norm );
+    for ( unsigned int r = 0; r < rows; r++ )
+      {
+      Y( r, j ) = ( norm > 1.e-12 ) ? Y( r, j ) / norm : 0;
+      }
+    }
+}
+
+/** Leading right singular vectors of A (samples x features) by a
+ * randomized range finder with power iterations (Halko, Martinsson and
+ * Tropp, SIAM Review 53:217-288, 2011).  Only a sketch of A with a few more
+ * columns than the wanted rank is ever decomposed.
+ *
+ * A target of at least one asks for that many components.  A target below
+ * one asks for the fewest components whose squared singular values hold
+ * that fraction of the squared Frobenius norm of A; the sketch then doubles
+ * until it holds the target with oversampling columns to spare, or until
+ * it spans A.  On return singularValues holds the kept singular values and
+ * varianceExplained their share of the squared Frobenius norm. */
+template< class T >
+vnl_matrix< T > randomizedSVDRightSingularVectors(
+  const vnl_matrix< T > & A,
+  double target,
+  vnl_vector< T > & singularValues,
+  double & varianceExplained,
+  unsigned int oversampling = 10,
+  unsigned int powerIterations = 2,
+  unsigned int seed = 0 )
+{
+  const unsigned int maximumRank = std::min( A.rows(), A.cols() );
+  double totalEnergy = 0;
+  for ( unsigned int i = 0; i < A.rows(); i++ )
+    {
+    for ( unsigned int j = 0; j < A.cols(); j++ )
+      {
+      totalEnergy += A( i, j ) * A( i, j );
+      }
+    }
+  unsigned int rank = maximumRank;
+  if ( target >= 1 )
+    {
+    rank = std::min( maximumRank, static_cast< unsigned int >( target ) );
+    }
+  unsigned int sketchSize = std::min( maximumRank,
+    ( target >= 1 ? rank : std::min( maximumRank, 16u ) ) + oversampling );
+
+  std::mt19937 generator( seed );
+  std::normal_distribution< double > gaussian( 0, 1 );
+  vnl_matrix< T > V;
+  vnl_vector< T > W;
+  while ( true )
+    {
+    vnl_matrix< T > omega( A.cols(), sketchSize );
+    for ( unsigned int i = 0; i < omega.rows(); i++ )
+      {
+      for ( unsigned int j = 0; j < omega.cols(); j++ )
+        {
+        omega( i, j ) = gaussian( generator );
+        }
+      }
+    vnl_matrix< T > Q = A * omega;
+    randomizedSVDOrthonormalizeColumns( Q );
+    for ( unsigned int q = 0; q < powerIterations; q++ )
+      {
+      vnl_matrix< T > Z = A.transpose() * Q;
+      randomizedSVDOrthonormalizeColumns( Z );
+      Q = A * Z;
+      randomizedSVDOrthonormalizeColumns( Q );
+      }
+    // B = Q^T A is small: sketchSize x features
+    vnl_svd< T > svd( Q.transpose() * A );
+    V = svd.V();
+    W.set_size( sketchSize );
+    for ( unsigned int i = 0; i < sketchSize; i++ )
+      {
+      W( i ) = svd.W( i );
+      }
+    if ( target >= 1 )
+      {
+      break;
+      }
+    double energy = 0;
+    rank = 0;
+    while ( rank < sketchSize && energy < target * totalEnergy )
+      {
+      energy += W( rank ) * W( rank );
+      rank++;
+      }
+    const bool reached = ( energy >= target * totalEnergy );
+    if ( ( reached && rank + oversampling <= sketchSize ) ||
+         sketchSize == maximumRank )
+      {
+      break;
+      }
+    sketchSize = std::min( maximumRank, 2 * sketchSize );
+    }
+
+  singularValues = W.extract( rank );
+  double energy = 0;
+  for ( unsigned int i = 0; i < rank; i++ )
+    {
+    energy += W( i ) * W( i );
+    }
+  varianceExplained = ( totalEnergy > 0 ) ? energy / totalEnergy : 0;
+  return V.get_n_columns( 0, rank );
+}
+
+#endif
@@ -5,7 +5,21 @@
 #include "itkImage.h"
 #include "itkVectorImage.h"
 #include "itkImageRegionIteratorWithIndex.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
+#include "itkConnectedComponentImageFilter.h"
+#include "itkRelabelComponentImageFilter.h"
 #include "antsSCCANObject.h"
+#include <vnl/vnl_matrix_ref.h>
+#include <vnl/vnl_fastops.h>
+#include <vnl/algo/vnl_symmetric_eigensystem.h>
+#include <vnl/algo/vnl_svd.h>
+#include "itkMultiThreaderBase.h"
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <numeric>
+#include <utility>
 using namespace Rcpp;
 
 RcppExport SEXP robustMatrixTransform( SEXP r_matrix )
@@ -15,43 +29,58 @@ try
   typedef double RealType;
   NumericMatrix M = as< NumericMatrix >( r_matrix );
   NumericMatrix outMat( M.rows(), M.cols() );
-  unsigned long rows = M.rows();
-  for( unsigned long j = 0; j < M.cols(); j++ )
+  const unsigned long rows = M.rows();
+  const unsigned long cols = M.cols();
+  const RealType * input = M.begin();
+  RealType * output = outMat.begin();
+  // rank(i) is the mean over k of sign( x_i - x_k ), i.e. the number of
+  // smaller minus the number of larger values over rows.  After sorting a
+  // column that is read off the bounds of the tie group of x_i.  NaN never
+  // compares, so it ranks 0 and does not count; an infinite value against
+  // a different one gives NaN, as inf / inf did in the pairwise sum.
+  itk::MultiThreaderBase::Pointer threader = itk::MultiThreaderBase::New();
+  threader->ParallelizeArray( 0, cols,
+    [&]( itk::SizeValueType j )
     {
-    NumericVector Mvec = M(_, j);
-    NumericVector rank = M(_, j);
-    for( unsigned int i = 0; i < rows; i++ )
+    const RealType * column = input + j * rows;
+    RealType * rank = output + j * rows;
+    std::vector< std::pair< RealType, unsigned long > > sorted;
+    sorted.reserve( rows );
+    bool hasInfinite = false;
+    for( unsigned long i = 0; i < rows; i++ )
       {
-      RealType   rankval = 0;
-      RealType   xi = Mvec(i);
-      for( unsigned int k = 0; k < rows; k++ )
+      rank[ i ] = 0;
+      if( !std::isnan( column[ i ] ) )
         {
-        RealType yi = Mvec(k);
-        RealType diff = fabs(xi - yi);
-        if( diff > 0 )
-          {
-          RealType val = (xi - yi) / diff;
-          rankval += val;
-          }
+        sorted.push_back( std::make_pair( column[ i ], i ) );
+        hasInfinite = hasInfinite || std::isinf( column[ i ] );
         }
-      rank(i) = rankval / rows;
       }
-    outMat(_, j) = rank;
-    }
-  // this passes rcpp data to vnl matrix ... safely?
-  if ( 1 == 0 )
-    {
-    // Further notes on this:
-    // 1. see multiChannel cpp for how to pass image list
-    // 2. separate implementation for eanat and sccan
-    // 3. deal with output as only matrix?
-    // 4. .... ?
-    std::vector<RealType> dat =
-      Rcpp::as< std::vector<RealType> >( outMat );
-    const double* _data = &dat[0];
-    vnl_matrix<RealType> vnlmat( _data , M.cols(), M.rows()  );
-    vnlmat = vnlmat.transpose();
-    }
+    std::sort( sorted.begin(), sorted.end() );
+    const unsigned long numberOfValues = sorted.size();
+    unsigned long lo = 0;
+    while( lo < numberOfValues )
+      {
+      unsigned long hi = lo + 1;
+      while( hi < numberOfValues && sorted[ hi ].first == sorted[ lo ].first )
+        {
+        hi++;
+        }
+      RealType rankval = ( static_cast< RealType >( lo ) -
+        static_cast< RealType >( numberOfValues - hi ) ) / rows;
+      const bool unequalInfinite = std::isinf( sorted[ lo ].first ) ?
+        ( hi - lo < numberOfValues ) : hasInfinite;
+      if( unequalInfinite )
+        {
+        rankval = std::numeric_limits< RealType >::quiet_NaN();
+        }
+      for( unsigned long k = lo; k < hi; k++ )
+        {
+        rank[ sorted[ k ].second ] = rankval;
+        }
+      lo = hi;
+      }
+    }, ITK_NULLPTR );
   return wrap( outMat );
 }
 catch( itk::ExceptionObject & err )
@@ -74,6 +103,383 @@ return Rcpp::wrap(NA_REAL); //not reached
 
 
 
+// sol (voxels x vecs, row-major) as the compressed sparse columns of its
+// transpose, i.e. of the vecs x voxels matrix handed back to R, with 0-based
+// row indices i, column pointers p and values x as in a Matrix dgCMatrix
+template< class MatrixType >
+Rcpp::List sccanSparseSolution( const MatrixType & sol )
+{
+  std::vector< int > i;
+  std::vector< double > x;
+  IntegerVector p( sol.rows() + 1 );
+  p[ 0 ] = 0;
+  for ( unsigned int voxel = 0; voxel < sol.rows(); voxel++ )
+    {
+    const typename MatrixType::element_type * row = sol[ voxel ];
+    for ( unsigned int vec = 0; vec < sol.cols(); vec++ )
+      {
+      if ( row[ vec ] != 0 )
+        {
+        i.push_back( vec );
+        x.push_back( row[ vec ] );
+        }
+      }
+    p[ voxel + 1 ] = i.size();
+    }
+  return Rcpp::List::create(
+    Rcpp::Named("i") = wrap( i ),
+    Rcpp::Named("p") = p,
+    Rcpp::Named("x") = wrap( x ),
+    Rcpp::Named("Dim") = IntegerVector::create( sol.cols(), sol.rows() ) );
+}
+
+// an initial solution from R, one vector per row over the matrix columns,
+// in the row-major layout the prior matrices take
+template< class MatrixType >
+MatrixType sccanInitialSolution( SEXP r_initial, unsigned long numberOfColumns )
+{
+  NumericMatrix initial( r_initial );
+  if ( static_cast< unsigned long >( initial.ncol() ) != numberOfColumns )
+    {
+    Rcpp::stop( "initial solution must have one column per matrix column" );
+    }
+  return vnl_matrix_ref< double >( initial.ncol(), initial.nrow(),
+    initial.begin() ).transpose();
+}
+
+// the leading right singular vectors of the matrix whose transpose is xt,
+// one per row, as a deterministic cold start for the threaded solver.
+// Vectors past the rank of the matrix start from a single voxel.
+template< class MatrixType >
+MatrixType sccanSpectralStart( const MatrixType & xt, unsigned int nvecs )
+{
+  // the Gram matrix of X straight from xt, with no transposed copy
+  vnl_matrix< double > gram;
+  vnl_fastops::AtA( gram, xt );
+  vnl_symmetric_eigensystem< double > eig( gram );
+  MatrixType start( nvecs, xt.rows(), 0 );
+  for ( unsigned int k = 0; k < nvecs; k++ )
+    {
+    if ( k < xt.cols() )
+      {
+      // the eigenvalues are in increasing order
+      vnl_vector< double > v = xt * eig.get_eigenvector( xt.cols() - 1 - k );
+      const double norm = v.two_norm();
+      if ( norm > 0 )
+        {
+        start.set_row( k, v / norm );
+        continue;
+        }
+      }
+    start( k, k % xt.rows() ) = 1;
+    }
+  return start;
+}
+
+// consecutive solutions (voxels x vecs) agree, vector by vector and up to
+// sign, to within tolerance in 1 - |cosine|
+template< class MatrixType >
+bool sccanSolutionConverged( const MatrixType & previous,
+  const MatrixType & current, double tolerance )
+{
+  if ( previous.rows() != current.rows() || previous.cols() != current.cols() )
+    {
+    return false;
+    }
+  for ( unsigned int k = 0; k < current.cols(); k++ )
+    {
+    const double previousNorm = previous.get_column( k ).two_norm();
+    const double currentNorm = current.get_column( k ).two_norm();
+    if ( previousNorm == 0 || currentNorm == 0 )
+      {
+      if ( previousNorm != currentNorm )
+        {
+        return false;
+        }
+      continue;
+      }
+    const double cosine = std::abs( dot_product( previous.get_column( k ),
+      current.get_column( k ) ) ) / ( previousNorm * currentNorm );
+    if ( 1 - cosine > tolerance )
+      {
+      return false;
+      }
+    }
+  return true;
+}
+
+// Sparse eigenanatomy by block power iteration on X^T X, run for powerit 2.
+// x is R's column-major subjects x voxels matrix, used in place.  V (voxels
+// x vecs) holds the starting point and returns the solution; U returns the
+// projections X V.  Both products run over tiles of voxels on the ITK
+// thread pool, and so do the soft threshold and the scatter and gather
+// around the cluster threshold.  Each vector is orthogonalized against the
+// vectors before it, soft thresholded to the fraction |sparseness| of the
+// voxels (dense outside (0,1)), kept positive when sparseness is positive,
+// cleared of clusters below minClusterSize within the mask and normalized.
+// The iterations stop once no vector changes by more than tolerance in
+// 1 - |cosine|, or after maxIterations.  Returns the fraction of the sum of
+// squares of X that the projections explain.
+template< class ImageType >
+double sccanThreadedSparseRecon( const double * x, unsigned long n,
+  itk::SizeValueType p, vnl_matrix< double > & V, vnl_matrix< double > & U,
+  double sparseness, unsigned int minClusterSize,
+  const ImageType * mask, unsigned int maxIterations, double tolerance,
+  unsigned int & iterations )
+{
+  enum { Dimension = ImageType::ImageDimension };
+  typedef itk::SizeValueType                        SizeValueType;
+  typedef itk::Image< unsigned char, Dimension >    BinaryImageType;
+  typedef itk::Image< unsigned int, Dimension >     LabelImageType;
+  typedef itk::ConnectedComponentImageFilter< BinaryImageType, LabelImageType >
+    ConnectedComponentType;
+  typedef itk::RelabelComponentImageFilter< LabelImageType, LabelImageType >
+    RelabelType;
+  const unsigned int nvecs = V.cols();
+  const SizeValueType blockSize = 4096;
+  const SizeValueType numberOfBlocks = ( p + blockSize - 1 ) / blockSize;
+  itk::MultiThreaderBase::Pointer threader = itk::MultiThreaderBase::New();
+
+  // U = X V.  Each tile of voxels sums into a buffer of its own, skipping
+  // the zero weights of the sparse vectors, and the buffers are added up.
+  std::vector< double > partial( numberOfBlocks * nvecs * n );
+  auto project = [&]( const vnl_matrix< double > & W, vnl_matrix< double > & P )
+    {
+    std::fill( partial.begin(), partial.end(), 0 );
+    threader->ParallelizeArray( 0, numberOfBlocks,
+      [&]( SizeValueType block )
+      {
+      double * const sums = &partial[ block * nvecs * n ];
+      const SizeValueType last = std::min( p, ( block + 1 ) * blockSize );
+      for ( SizeValueType j = block * blockSize; j < last; j++ )
+        {
+        const double * const column = x + j * n;
+        for ( unsigned int k = 0; k < nvecs; k++ )
+          {
+          const double weight = W( j, k );
+          if ( weight == 0 )
+            {
+            continue;
+            }
+          double * const s = sums + k * n;
+          for ( unsigned long i = 0; i < n; i++ )
+            {
+            s[ i ] += weight * column[ i ];
+            }
+          }
+        }
+      }, ITK_NULLPTR );
+    P.set_size( n, nvecs );
+    P.fill( 0 );
+    for ( SizeValueType block = 0; block < numberOfBlocks; block++ )
+      {
+      for ( unsigned int k = 0; k < nvecs; k++ )
+        {
+        const double * const s = &partial[ ( block * nvecs + k ) * n ];
+        for ( unsigned long i = 0; i < n; i++ )
+          {
+          P( i, k ) += s[ i ];
+          }
+        }
+      }
+    };
+  // G = X^T P, a dot product of contiguous columns per voxel and vector
+  auto backProject = [&]( const vnl_matrix< double > & P, vnl_matrix< double > & G )
+    {
+    const vnl_matrix< double > Pt = P.transpose();
+    G.set_size( p, nvecs );
+    threader->ParallelizeArray( 0, numberOfBlocks,
+      [&]( SizeValueType block )
+      {
+      const SizeValueType last = std::min( p, ( block + 1 ) * blockSize );
+      for ( SizeValueType j = block * blockSize; j < last; j++ )
+        {
+        const double * const column = x + j * n;
+        for ( unsigned int k = 0; k < nvecs; k++ )
+          {
+          const double * const q = Pt[ k ];
+          double sum = 0;
+          for ( unsigned long i = 0; i < n; i++ )
+            {
+            sum += column[ i ] * q[ i ];
+            }
+          G( j, k ) = sum;
+          }
+        }
+      }, ITK_NULLPTR );
+    };
+
+  // matrix column j is the j-th voxel of the mask, as for the priors
+  const bool clusterThreshold = ( mask != ITK_NULLPTR ) && ( minClusterSize > 0 );
+  std::vector< itk::OffsetValueType > offsets;
+  typename BinaryImageType::Pointer binary;
+  if ( clusterThreshold )
+    {
+    itk::ImageRegionConstIteratorWithIndex< ImageType > it( mask,
+      mask->GetLargestPossibleRegion() );
+    for ( it.GoToBegin(); !it.IsAtEnd() && offsets.size() < p; ++it )
+      {
+      if ( it.Get() >= 0.5 )
+        {
+        offsets.push_back( mask->ComputeOffset( it.GetIndex() ) );
+        }
+      }
+    binary = BinaryImageType::New();
+    binary->CopyInformation( mask );
+    binary->SetRegions( mask->GetLargestPossibleRegion() );
+    binary->Allocate();
+    }
+
+  const double fraction = std::abs( sparseness );
+  const bool sparsify = ( fraction > 0 ) && ( fraction < 1 );
+  const SizeValueType keep = static_cast< SizeValueType >(
+    std::ceil( fraction * p ) );
+  std::vector< double > v( p );
+  std::vector< double > magnitude;
+  vnl_matrix< double > G;
+  vnl_matrix< double > next( p, nvecs );
+  iterations = 0;
+  while ( iterations < maxIterations )
+    {
+    project( V, U );
+    backProject( U, G );
+    for ( unsigned int k = 0; k < nvecs; k++ )
+      {
+      for ( SizeValueType j = 0; j < p; j++ )
+        {
+        v[ j ] = G( j, k );
+        }
+      for ( unsigned int l = 0; l < k; l++ )
+        {
+        double projection = 0;
+        for ( SizeValueType j = 0; j < p; j++ )
+          {
+          projection += v[ j ] * next( j, l );
+          }
+        for ( SizeValueType j = 0; j < p; j++ )
+          {
+          v[ j ] -= projection * next( j, l );
+          }
+        }
+      if ( sparsify )
+        {
+        // positive vectors take the sign that puts most weight above zero
+        if ( sparseness > 0 && std::accumulate( v.begin(), v.end(), 0.0 ) < 0 )
+          {
+          for ( SizeValueType j = 0; j < p; j++ )
+            {
+            v[ j ] = -v[ j ];
+            }
+          }
+        magnitude.resize( p );
+        threader->ParallelizeArray( 0, numberOfBlocks,
+          [&]( SizeValueType block )
+          {
+          const SizeValueType last = std::min( p, ( block + 1 ) * blockSize );
+          for ( SizeValueType j = block * blockSize; j < last; j++ )
+            {
+            magnitude[ j ] = ( sparseness > 0 && v[ j ] < 0 ) ? 0 : std::abs( v[ j ] );
+            }
+          }, ITK_NULLPTR );
+        // the largest magnitude left out is the threshold
+        double threshold = 0;
+        if ( keep < p )
+          {
+          std::nth_element( magnitude.begin(), magnitude.begin() + keep,
+            magnitude.end(), std::greater< double >() );
+          threshold = magnitude[ keep ];
+          }
+        threader->ParallelizeArray( 0, numberOfBlocks,
+          [&]( SizeValueType block )
+          {
+          const SizeValueType last = std::min( p, ( block + 1 ) * blockSize );
+          for ( SizeValueType j = block * blockSize; j < last; j++ )
+            {
+            const double a = ( sparseness > 0 && v[ j ] < 0 ) ? 0 : std::abs( v[ j ] );
+            v[ j ] = ( a > threshold ) ?
+              ( v[ j ] < 0 ? threshold - a : a - threshold ) : 0;
+            }
+          }, ITK_NULLPTR );
+        }
+      if ( clusterThreshold )
+        {
+        binary->FillBuffer( 0 );
+        unsigned char * const buffer = binary->GetBufferPointer();
+        const SizeValueType numberOfVoxels = offsets.size();
+        threader->ParallelizeArray( 0, numberOfBlocks,
+          [&]( SizeValueType block )
+          {
+          const SizeValueType last = std::min( numberOfVoxels, ( block + 1 ) * blockSize );
+          for ( SizeValueType j = block * blockSize; j < last; j++ )
+            {
+            buffer[ offsets[ j ] ] = ( v[ j ] != 0 );
+            }
+          }, ITK_NULLPTR );
+        binary->Modified();
+        typename ConnectedComponentType::Pointer connected =
+          ConnectedComponentType::New();
+        connected->SetInput( binary );
+        typename RelabelType::Pointer relabel = RelabelType::New();
+        relabel->SetInput( connected->GetOutput() );
+        relabel->SetMinimumObjectSize( minClusterSize );
+        relabel->Update();
+        const unsigned int * const labels = relabel->GetOutput()->GetBufferPointer();
+        threader->ParallelizeArray( 0, numberOfBlocks,
+          [&]( SizeValueType block )
+          {
+          const SizeValueType last = std::min( numberOfVoxels, ( block + 1 ) * blockSize );
+          for ( SizeValueType j = block * blockSize; j < last; j++ )
+            {
+            if ( labels[ offsets[ j ] ] == 0 )
+              {
+              v[ j ] = 0;
+              }
+            }
+          }, ITK_NULLPTR );
+        }
+      double norm = 0;
+      for ( SizeValueType j = 0; j < p; j++ )
+        {
+        norm += v[ j ] * v[ j ];
+        }
+      norm = std::sqrt( norm );
+      for ( SizeValueType j = 0; j < p; j++ )
+        {
+        next( j, k ) = ( norm > 0 ) ? v[ j ] / norm : 0;
+        }
+      }
+    iterations++;
+    const bool converged = ( tolerance > 0 ) &&
+      sccanSolutionConverged( V, next, tolerance );
+    V = next;
+    if ( converged )
+      {
+      break;
+      }
+    }
+
+  // the share of the sum of squares of X in the span of U = X V, which is
+  // trace( (U^T U)^+ H^T H ) with H = X^T U
+  project( V, U );
+  backProject( U, G );
+  vnl_matrix< double > UtU;
+  vnl_matrix< double > HtH;
+  vnl_fastops::AtA( UtU, U );
+  vnl_fastops::AtA( HtH, G );
+  const vnl_matrix< double > weighted = vnl_svd< double >( UtU ).pinverse() * HtH;
+  double explained = 0;
+  for ( unsigned int k = 0; k < nvecs; k++ )
+    {
+    explained += weighted( k, k );
+    }
+  double total = 0;
+  for ( SizeValueType j = 0; j < n * p; j++ )
+    {
+    total += x[ j ] * x[ j ];
+    }
+  return ( total > 0 ) ? explained / total : 0;
+}
+
 template< class ImageType, class IntType, class RealType >
 SEXP eigenanatomyCppHelper(
   NumericMatrix X,
@@ -91,7 +497,10 @@ SEXP eigenanatomyCppHelper(
   IntType verbose,
   IntType powerit,
   RealType priorWeight,
-  IntType useMaxBasedThresh )
+  IntType useMaxBasedThresh,
+  bool sparseOutput,
+  SEXP r_initialP,
+  RealType tolerance )
 {
   enum { Dimension = ImageType::ImageDimension };
   typename ImageType::RegionType region;
@@ -104,6 +513,8 @@ SEXP eigenanatomyCppHelper(
 
   typename ImageType::Pointer mask = Rcpp::as<ImagePointerType>( r_mask );
   bool maskisnull = mask.IsNull();
+  // the starting point of the threaded solver, one vector per row
+  vMatrix startP;
 // deal with the initializationList, if any
   unsigned int nImages = initializationList.size();
   if ( ( nImages > 0 ) && ( !maskisnull ) )
@@ -121,7 +532,8 @@ SEXP eigenanatomyCppHelper(
       while ( !it.IsAtEnd() )
         {
         PixelType pix = it.Get();
-        if ( pix >= 0.5 )
+        // a mask with more voxels than matrix columns fills only the columns
+        if ( pix >= 0.5 && ct < priorROIMat.cols() )
           {
           pix = init->GetPixel( it.GetIndex() );
           priorROIMat( i, ct ) = pix;
@@ -131,18 +543,12 @@ SEXP eigenanatomyCppHelper(
         }
       }
     sccanobj->SetMatrixPriorROI( priorROIMat );
+    startP = priorROIMat;
     nvecs = nImages;
     }
   sccanobj->SetPriorWeight( priorWeight );
   sccanobj->SetLambda( priorWeight );
   sccanobj->SetMaxBasedThresholding( useMaxBasedThresh );
-// cast hack from Rcpp type to sccan type
-  std::vector<double> xdat =
-      Rcpp::as< std::vector<double> >( X );
-  const double* _xdata = &xdat[0];
-  vMatrix vnlX( _xdata , X.cols(), X.rows()  );
-  vnlX = vnlX.transpose();
-
   sccanobj->SetGetSmall( false  );
   vMatrix priorROIMat;
 
@@ -166,17 +572,86 @@ SEXP eigenanatomyCppHelper(
   sccanobj->SetSCCANFormulation(  SCCANType::PQ );
   sccanobj->SetFractionNonZeroP( fabs( sparseness ) );
   sccanobj->SetMinClusterSizeP( cthresh );
-  sccanobj->SetMatrixP( vnlX );
+  // R's column-major buffer read row-major is X transposed.  Transposing a
+  // view on it builds the row-major X that sccan takes, which is the one
+  // copy made here; SetMatrixP then keeps copies of its own.  The threaded
+  // solver reads R's buffer directly and needs no copy.
+  if ( powerit != 2 )
+    {
+    sccanobj->SetMatrixP( vnl_matrix_ref< Scalar >( X.cols(), X.rows(), X.begin() ).transpose() );
+    }
 //  sccanobj->SetMatrixR( r ); // FIXME
   sccanobj->SetMaskImageP( mask );
+  // the solver starts from the prior matrix, which SparseReconPrior with
+  // no prior weight uses as a starting point only
+  bool warmStart = false;
+  if ( !Rf_isNull( r_initialP ) )
+    {
+    const vMatrix initialP = sccanInitialSolution< vMatrix >( r_initialP, X.cols() );
+    if ( initialP.rows() != nvecs )
+      {
+      Rcpp::stop( "the number of vectors in the initial solution must equal nvecs" );
+      }
+    sccanobj->SetMatrixPriorROI( initialP );
+    startP = initialP;
+    warmStart = true;
+    }
+  // a cold start runs the chosen solver for all its iterations in one call.
+  // From an initial solution with a tolerance, SparseReconPrior instead
+  // runs one iteration at a time from the last solution until the solution
+  // stops changing; SparseReconHome takes no starting point and the
+  // prior-weighted solver needs the prior matrix, so those run in one call.
+  // The threaded solver of powerit 2 checks the tolerance itself.
+  const bool stepwise = warmStart && ( tolerance > 0 ) &&
+    ( powerit != 1 ) && ( powerit != 2 ) && !( priorWeight > 1.e-12 );
   RealType truecorr = 0;
-  if( powerit == 1 )
+  // one-call solvers do not report their iterations and run all of them
+  unsigned int iterations = its;
+  vMatrix solU;
+  vMatrix solV;
+  if ( powerit == 2 )
+    {
+    if ( startP.rows() == 0 )
+      {
+      startP = sccanSpectralStart< vMatrix >(
+        vnl_matrix_ref< Scalar >( X.cols(), X.rows(), X.begin() ), nvecs );
+      }
+    solV = startP.transpose();
+    truecorr = sccanThreadedSparseRecon< ImageType >( X.begin(), X.rows(),
+      X.cols(), solV, solU, sparseness, cthresh,
+      maskisnull ? ITK_NULLPTR : mask.GetPointer(), its, tolerance,
+      iterations );
+    }
+  else if ( stepwise )
+    {
+    sccanobj->SetMaximumNumberOfIterations( 1 );
+    iterations = 0;
+    vMatrix previous;
+    while ( iterations < its )
+      {
+      truecorr = sccanobj->SparseReconPrior( nvecs, true );
+      iterations++;
+      const vMatrix current = sccanobj->GetVariatesP();
+      if ( iterations > 1 && sccanSolutionConverged( previous, current, tolerance ) )
+        {
+        break;
+        }
+      previous = current;
+      sccanobj->SetMatrixPriorROI( current.transpose() );
+      }
+    }
+  else if( powerit == 1 )
     {
     truecorr = sccanobj->SparseReconHome( nvecs );
     }
-  else if ( priorWeight > 1.e-12 )
+  else if ( priorWeight > 1.e-12 || warmStart )
     truecorr = sccanobj->SparseReconPrior( nvecs, true );
   else truecorr = sccanobj->SparseRecon(nvecs);
+  if ( powerit != 2 )
+    {
+    solU = sccanobj->GetMatrixU();
+    solV = sccanobj->GetVariatesP();
+    }
   /*
   else if( powerit != 0 )
     {
@@ -212,32 +687,27 @@ SEXP eigenanatomyCppHelper(
     }
   */
 
-  // solutions should be much smaller so may not be a big deal to copy
-  // FIXME - should not copy, should map memory
-  vMatrix solV = sccanobj->GetVariatesP();
-  NumericMatrix eanatMat( solV.cols(), solV.rows() );
-  unsigned long rows = solV.rows();
-  for( unsigned long c = 0; c < solV.cols(); c++ )
-    {
-    for( unsigned int r = 0; r < rows; r++ )
-      {
-      eanatMat( c, r ) = solV( r, c );
-      }
-    }
-  vMatrix solU = sccanobj->GetMatrixU();
   NumericMatrix eanatMatU( solU.rows(), solU.cols() );
-  rows = solU.rows();
-  for( unsigned long c = 0; c < solU.cols(); c++ )
+  solU.transpose().copy_out( eanatMatU.begin() );
+  if ( sparseOutput )
     {
-    for( unsigned int r = 0; r < rows; r++ )
-      {
-      eanatMatU( r, c) = solU( r, c);
-      }
+    return(
+        Rcpp::List::create(
+          Rcpp::Named("eigenanatomyimages") = sccanSparseSolution( solV ),
+          Rcpp::Named("umatrix") = eanatMatU,
+          Rcpp::Named("iterations") = static_cast< int >( iterations ),
+          Rcpp::Named("varex") = truecorr )
+        );
     }
+  // the row-major solution is the column-major transpose, which is what
+  // is returned, so its buffer goes to R as is
+  NumericMatrix eanatMat( solV.cols(), solV.rows() );
+  solV.copy_out( eanatMat.begin() );
   return(
       Rcpp::List::create(
         Rcpp::Named("eigenanatomyimages") = eanatMat,
         Rcpp::Named("umatrix") = eanatMatU,
+        Rcpp::Named("iterations") = static_cast< int >( iterations ),
         Rcpp::Named("varex") = truecorr )
       );
 }
@@ -257,7 +727,10 @@ RcppExport SEXP eigenanatomyCpp(
   SEXP r_verbose,
   SEXP r_powerit,
   SEXP r_priorWeight,
-  SEXP r_maxBasedThresh )
+  SEXP r_maxBasedThresh,
+  SEXP r_sparseOutput,
+  SEXP r_initialP,
+  SEXP r_tolerance )
 {
 try
 {
@@ -279,6 +752,8 @@ try
   IntType powerit = Rcpp::as< RealType >( r_powerit );
   RealType priorWeight = Rcpp::as< RealType >( r_priorWeight );
   IntType maxBasedThresh = Rcpp::as< IntType >( r_maxBasedThresh );
+  bool sparseOutput = Rcpp::as< bool >( r_sparseOutput );
+  RealType tolerance = Rcpp::as< RealType >( r_tolerance );
 
 //[1] "projections"        "eigenanatomyimages" "umatrix"
   typedef itk::Image<RealType,3> Image3Type;
@@ -300,7 +775,10 @@ try
         verbose,
         powerit,
         priorWeight,
-        maxBasedThresh
+        maxBasedThresh,
+        sparseOutput,
+        r_initialP,
+        tolerance
         )
       );
   if ( dimension == 3 )
@@ -320,7 +798,10 @@ try
         verbose,
         powerit,
         priorWeight,
-        maxBasedThresh
+        maxBasedThresh,
+        sparseOutput,
+        r_initialP,
+        tolerance
         )
       );
 }
@@ -367,7 +848,11 @@ SEXP sccanCppHelper(
   RealType ell1,
   IntType verbose,
   RealType priorWeight,
-  IntType useMaxBasedThresh )
+  IntType useMaxBasedThresh,
+  bool sparseOutput,
+  SEXP r_initialP,
+  SEXP r_initialQ,
+  RealType tolerance )
 {
   enum { Dimension = ImageType::ImageDimension };
   typename ImageType::RegionType region;
@@ -400,7 +885,8 @@ SEXP sccanCppHelper(
       while ( !it.IsAtEnd() )
         {
         PixelType pix = it.Get();
-        if ( pix >= 0.5 )
+        // a mask with more voxels than matrix columns fills only the columns
+        if ( pix >= 0.5 && ct < priorROIMatx.cols() )
           {
           pix = init->GetPixel( it.GetIndex() );
           priorROIMatx( i, ct ) = pix;
@@ -428,7 +914,8 @@ SEXP sccanCppHelper(
       while ( !it.IsAtEnd() )
         {
         PixelType pix = it.Get();
-        if ( pix >= 0.5 )
+        // a mask with more voxels than matrix columns fills only the columns
+        if ( pix >= 0.5 && ct < priorROIMaty.cols() )
           {
           pix = init->GetPixel( it.GetIndex() );
           priorROIMaty( i, ct ) = pix;
@@ -443,18 +930,6 @@ SEXP sccanCppHelper(
 
   sccanobj->SetPriorWeight( priorWeight );
   sccanobj->SetLambda( priorWeight );
-// cast hack from Rcpp type to sccan type
-  std::vector<double> xdat =
-      Rcpp::as< std::vector<double> >( X );
-  const double* _xdata = &xdat[0];
-  vMatrix vnlX( _xdata , X.cols(), X.rows()  );
-  vnlX = vnlX.transpose();
-  std::vector<double> ydat =
-      Rcpp::as< std::vector<double> >( Y );
-  const double* _ydata = &ydat[0];
-  vMatrix vnlY( _ydata , Y.cols(), Y.rows()  );
-  vnlY = vnlY.transpose();
-// cast hack done
   sccanobj->SetGetSmall( false  );
   sccanobj->SetCovering( covering );
   sccanobj->SetSilent(  ! verbose  );
@@ -477,40 +952,87 @@ SEXP sccanCppHelper(
   sccanobj->SetFractionNonZeroQ( fabs( sparsenessy ) );
   sccanobj->SetMinClusterSizeP( cthreshx );
   sccanobj->SetMinClusterSizeQ( cthreshy );
-  sccanobj->SetMatrixP( vnlX );
-  sccanobj->SetMatrixQ( vnlY );
+  // one row-major copy of each input, as in eigenanatomyCppHelper
+  sccanobj->SetMatrixP( vnl_matrix_ref< Scalar >( X.cols(), X.rows(), X.begin() ).transpose() );
+  sccanobj->SetMatrixQ( vnl_matrix_ref< Scalar >( Y.cols(), Y.rows(), Y.begin() ).transpose() );
 //  sccanobj->SetMatrixR( r ); // FIXME
   sccanobj->SetMaskImageP( maskx );
   sccanobj->SetMaskImageQ( masky );
-  sccanobj->SparsePartialArnoldiCCA( nvecs );
-
-  // FIXME - should not copy, should map memory
-  vMatrix solP = sccanobj->GetVariatesP();
-  NumericMatrix eanatMatp( solP.cols(), solP.rows() );
-  unsigned long rows = solP.rows();
-  for( unsigned long c = 0; c < solP.cols(); c++ )
+  if ( !Rf_isNull( r_initialP ) )
     {
-    for( unsigned int r = 0; r < rows; r++ )
+    const vMatrix initialP = sccanInitialSolution< vMatrix >( r_initialP, X.cols() );
+    if ( initialP.rows() != nvecs )
       {
-      eanatMatp( c, r ) = solP( r, c );
+      Rcpp::stop( "the number of vectors in the initial solution must equal nvecs" );
       }
+    sccanobj->SetMatrixPriorROI( initialP );
     }
-
-  vMatrix solQ = sccanobj->GetVariatesQ();
-  NumericMatrix eanatMatq( solQ.cols(), solQ.rows() );
-  rows = solQ.rows();
-  for( unsigned long c = 0; c < solQ.cols(); c++ )
+  if ( !Rf_isNull( r_initialQ ) )
+    {
+    const vMatrix initialQ = sccanInitialSolution< vMatrix >( r_initialQ, Y.cols() );
+    if ( initialQ.rows() != nvecs )
+      {
+      Rcpp::stop( "the number of vectors in the initial solution must equal nvecs" );
+      }
+    sccanobj->SetMatrixPriorROI2( initialQ );
+    }
+  // as in eigenanatomyCppHelper, only a warm start with a tolerance runs
+  // one iteration at a time, restarting both views from the last solution
+  const bool stepwise = ( !Rf_isNull( r_initialP ) || !Rf_isNull( r_initialQ ) ) &&
+    ( tolerance > 0 ) && !( priorWeight > 1.e-10 );
+  IntType iterations = its;
+  if ( !stepwise )
+    {
+    sccanobj->SparsePartialArnoldiCCA( nvecs );
+    }
+  else
     {
-    for( unsigned int r = 0; r < rows; r++ )
+    sccanobj->SetMaximumNumberOfIterations( 1 );
+    iterations = 0;
+    vMatrix previousP;
+    vMatrix previousQ;
+    while ( iterations < its )
       {
-      eanatMatq( c, r ) = solQ( r, c );
+      sccanobj->SparsePartialArnoldiCCA( nvecs );
+      iterations++;
+      const vMatrix currentP = sccanobj->GetVariatesP();
+      const vMatrix currentQ = sccanobj->GetVariatesQ();
+      if ( iterations > 1 &&
+           sccanSolutionConverged( previousP, currentP, tolerance ) &&
+           sccanSolutionConverged( previousQ, currentQ, tolerance ) )
+        {
+        break;
+        }
+      previousP = currentP;
+      previousQ = currentQ;
+      sccanobj->SetMatrixPriorROI( currentP.transpose() );
+      sccanobj->SetMatrixPriorROI2( currentQ.transpose() );
       }
     }
 
+  const vMatrix solP = sccanobj->GetVariatesP();
+  const vMatrix solQ = sccanobj->GetVariatesQ();
+  if ( sparseOutput )
+    {
+    return(
+        Rcpp::List::create(
+          Rcpp::Named("eig1") = sccanSparseSolution( solP ),
+          Rcpp::Named("eig2") = sccanSparseSolution( solQ ),
+          Rcpp::Named("iterations") = static_cast< int >( iterations ) )
+        );
+    }
+  // returned transposed, i.e. the row-major buffers as is
+  NumericMatrix eanatMatp( solP.cols(), solP.rows() );
+  solP.copy_out( eanatMatp.begin() );
+
+  NumericMatrix eanatMatq( solQ.cols(), solQ.rows() );
+  solQ.copy_out( eanatMatq.begin() );
+
   return(
       Rcpp::List::create(
         Rcpp::Named("eig1") = eanatMatp,
-        Rcpp::Named("eig2") = eanatMatq )
+        Rcpp::Named("eig2") = eanatMatq,
+        Rcpp::Named("iterations") = static_cast< int >( iterations ) )
       );
 }
 
@@ -535,7 +1057,11 @@ RcppExport SEXP sccanCpp(
   SEXP r_ell1,
   SEXP r_verbose,
   SEXP r_priorWeight,
-  SEXP r_maxBasedThresh )
+  SEXP r_maxBasedThresh,
+  SEXP r_sparseOutput,
+  SEXP r_initialP,
+  SEXP r_initialQ,
+  SEXP r_tolerance )
 {
 try
 {
@@ -557,6 +1083,8 @@ try
   Rcpp::List initializationListy( r_initializationListy );
   IntType mycoption = Rcpp::as< IntType >( r_mycoption );
   IntType maxBasedThresh = Rcpp::as< IntType >( r_maxBasedThresh );
+  bool sparseOutput = Rcpp::as< bool >( r_sparseOutput );
+  RealType tolerance = Rcpp::as< RealType >( r_tolerance );
   RealType ell1 = Rcpp::as< RealType >( r_ell1 );
   IntType verbose = Rcpp::as< RealType >( r_verbose );
   RealType priorWeight = Rcpp::as< RealType >( r_priorWeight );
@@ -583,7 +1111,11 @@ try
         ell1,
         verbose,
         priorWeight,
-        maxBasedThresh
+        maxBasedThresh,
+        sparseOutput,
+        r_initialP,
+        r_initialQ,
+        tolerance
         )
       );
   if ( dimension == 3 )
@@ -607,7 +1139,11 @@ try
         ell1,
         verbose,
         priorWeight,
-        maxBasedThresh
+        maxBasedThresh,
+        sparseOutput,
+        r_initialP,
+        r_initialQ,
+        tolerance
         )
       );
 }